@@ -0,0 +1,138 @@
+#include "Alarm.hh"
+
+using namespace Pds::Jungfrau;
+
+const char* const Alarm::LEVELS[] = { "OK", "LOW", "HIGH" };
+const char* const Alarm::ACTIONS[] = { "NONE", "OFF", "BLOCK" };
+
+Alarm::Alarm(std::string name, unsigned source, unsigned index) :
+  _name(name),
+  _source(source),
+  _index(index),
+  _hysteresis(0),
+  _debounce(1),
+  _level(OK),
+  _pending(OK),
+  _count(0)
+{
+  for (unsigned i=0; i<NUM_LEVELS; i++) {
+    _has_limit[i] = false;
+    _limit[i] = 0;
+  }
+}
+
+Alarm::~Alarm()
+{}
+
+std::string Alarm::name() const
+{
+  return _name;
+}
+
+unsigned Alarm::source() const
+{
+  return _source;
+}
+
+unsigned Alarm::index() const
+{
+  return _index;
+}
+
+bool Alarm::enabled() const
+{
+  return _has_limit[LOW] || _has_limit[HIGH];
+}
+
+bool Alarm::has_limit(Level level) const
+{
+  return _has_limit[level];
+}
+
+int Alarm::limit(Level level) const
+{
+  return _limit[level];
+}
+
+void Alarm::set_limit(Level level, int value)
+{
+  _has_limit[level] = true;
+  _limit[level] = value;
+  reset();
+}
+
+void Alarm::clear_limit(Level level)
+{
+  _has_limit[level] = false;
+  reset();
+}
+
+int Alarm::hysteresis() const
+{
+  return _hysteresis;
+}
+
+void Alarm::set_hysteresis(int value)
+{
+  _hysteresis = value < 0 ? -value : value;
+}
+
+unsigned Alarm::debounce() const
+{
+  return _debounce;
+}
+
+void Alarm::set_debounce(unsigned count)
+{
+  _debounce = count > 0 ? count : 1;
+  _count = 0;
+}
+
+Alarm::Level Alarm::level() const
+{
+  return _level;
+}
+
+bool Alarm::update(int value)
+{
+  Level level = classify(value);
+  if (level == _level) {
+    _count = 0;
+    return false;
+  }
+
+  // only believe a new level once it has been seen enough times in a row
+  if (level != _pending) {
+    _pending = level;
+    _count = 0;
+  }
+  if (++_count < _debounce) {
+    return false;
+  }
+  _level = level;
+  _count = 0;
+  return true;
+}
+
+void Alarm::reset()
+{
+  _level = OK;
+  _pending = OK;
+  _count = 0;
+}
+
+Alarm::Level Alarm::classify(int value) const
+{
+  // stay tripped until the value is back past the threshold by the hysteresis
+  if (_level == HIGH && _has_limit[HIGH] && value > _limit[HIGH] - _hysteresis) {
+    return HIGH;
+  } else if (_level == LOW && _has_limit[LOW] && value < _limit[LOW] + _hysteresis) {
+    return LOW;
+  } else if (_has_limit[HIGH] && value > _limit[HIGH]) {
+    return HIGH;
+  } else if (_has_limit[LOW] && value < _limit[LOW]) {
+    return LOW;
+  } else {
+    return OK;
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef Pds_Jungfrau_Alarm_hh
+#define Pds_Jungfrau_Alarm_hh
+
+#include <string>
+
+namespace Pds {
+  namespace Jungfrau {
+    /*
+     * High and low thresholds on one monitored value. A change of level
+     * needs debounce samples in a row, and a tripped alarm only clears
+     * once the value is back inside the threshold by the hysteresis.
+     */
+    class Alarm {
+    public:
+      enum Level { OK, LOW, HIGH, NUM_LEVELS };
+      enum Action { NONE, OFF, BLOCK, NUM_ACTIONS };
+
+      Alarm(std::string name, unsigned source, unsigned index);
+      ~Alarm();
+
+      std::string name() const;
+      unsigned source() const;
+      unsigned index() const;
+      bool enabled() const;
+      bool has_limit(Level level) const;
+      int limit(Level level) const;
+      void set_limit(Level level, int value);
+      void clear_limit(Level level);
+      int hysteresis() const;
+      void set_hysteresis(int value);
+      unsigned debounce() const;
+      void set_debounce(unsigned count);
+      Level level() const;
+      bool update(int value);
+      void reset();
+
+      static const char* const LEVELS[];
+      static const char* const ACTIONS[];
+
+    private:
+      Level classify(int value) const;
+
+    private:
+      std::string _name;
+      unsigned    _source;
+      unsigned    _index;
+      bool        _has_limit[NUM_LEVELS];
+      int         _limit[NUM_LEVELS];
+      int         _hysteresis;
+      unsigned    _debounce;
+      Level       _level;
+      Level       _pending;
+      unsigned    _count;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,322 @@
+#include "Backend.hh"
+#include "Simulator.hh"
+
+#include <sys/stat.h>
+#include <cmath>
+#include <sstream>
+#include <fstream>
+
+using namespace Pds::Jungfrau;
+
+Backend::Backend()
+{}
+
+Backend::~Backend()
+{}
+
+SysfsBackend::SysfsBackend(std::string path) :
+  _sep('/'),
+  _path(path)
+{}
+
+SysfsBackend::~SysfsBackend()
+{}
+
+std::string SysfsBackend::read_raw_value(const std::string& key)
+{
+  std::string result;
+
+  // read the file
+  std::ifstream file(filename(key).c_str());
+  if (file.is_open()) {
+    file >> result;
+    file.close();
+  }
+
+  return result;
+}
+
+int SysfsBackend::read_value(const std::string& key)
+{
+  int result = -1;
+
+  // read the file
+  std::ifstream file(filename(key).c_str());
+  if (file.is_open()) {
+    file >> result;
+    file.close();
+  }
+
+  return result;
+}
+
+bool SysfsBackend::write_value(unsigned value, const std::string& key)
+{
+  std::ofstream file(filename(key).c_str());
+  if (file.is_open()) {
+    file << value;
+    file.close();
+    return true;
+  } else {
+    return false;
+  }
+}
+
+bool SysfsBackend::exists(const std::string& key)
+{
+  struct stat buf;
+  return stat(filename(key).c_str(), &buf) == 0;
+}
+
+std::string SysfsBackend::filename(const std::string& key) const
+{
+  return _path + _sep + key;
+}
+
+MemoryBackend::MemoryBackend(const unsigned num_ps,
+                             const unsigned num_gpios,
+                             const unsigned num_gfm,
+                             const unsigned num_fan,
+                             double tau_on,
+                             double tau_off) :
+  _num_ps(num_ps),
+  _num_gpios(num_gpios),
+  _ps_power(num_ps > 0 ? new unsigned[num_ps] : NULL),
+  _gpio_onoff(num_gpios > 0 ? new unsigned[num_gpios] : NULL),
+  _mcb(num_gpios > 0 ? new unsigned[num_gpios] : NULL),
+  _supply(num_ps > 0 ? new SupplyModel*[num_ps] : NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+  // mirror the initial state created by make_sim.sh
+  for (unsigned i=0; i<num_ps; i++) {
+    _ps_power[i] = 0;
+    _supply[i] = new SupplyModel(tau_on, tau_off);
+    add_name(key("hwmon/ps", i, "name"), "cpfe1000fi");
+    add(key("hwmon/ps", i, "set_power"), PS_POWER, i);
+    add(key("hwmon/ps", i, "temp_input"), PS_TEMP, i);
+    add(key("hwmon/ps", i, "volt_input"), PS_VOLT, i);
+    add(key("hwmon/ps", i, "curr_input"), PS_CURR, i);
+  }
+  for (unsigned k=0; k<num_gfm; k++) {
+    add_name(key("hwmon/gfm", k, "name"), "gfm");
+    add(key("hwmon/gfm", k, "flow_input"), GFM_FLOW, k, 0, 14000);
+    add(key("hwmon/gfm", k, "temp_input"), STATIC, k, 0, 15200);
+  }
+  for (unsigned l=0; l<num_fan; l++) {
+    add_name(key("hwmon/fan", l, "name"), "max6650");
+    add(key("hwmon/fan", l, "fan1_input"), FAN_INPUT, l, 0, 30);
+    add(key("hwmon/fan", l, "fan1_target"), STATIC, l, 0, 238125);
+    add(key("hwmon/fan", l, "fan1_div"), STATIC, l, 0, 4);
+  }
+  add(key("gpios", -1, "get_autostart_enable"), STATIC, 0, 0, 1);
+  add(key("gpios", -1, "get_fanctrl_enable"), STATIC, 0, 0, 1);
+  add(key("gpios", -1, "get_flowmeter_enable"), STATIC, 0, 0, 1);
+  add(key("gpios", -1, "get_inhibit"), STATIC, 0, 0, 0);
+  add(key("gpios", -1, "get_inhibit_enable"), STATIC, 0, 0, 1);
+  add(key("gpios", -1, "get_powerswitch"), STATIC, 0, 0, 1);
+  add(key("gpios", -1, "set_led_green"), STATIC, 0, 0, 0);
+  add(key("gpios", -1, "set_led_red"), STATIC, 0, 0, 0);
+  add(key("gpios", -1, "set_led_yellow"), STATIC, 0, 0, 0);
+  for (unsigned j=0; j<num_gpios; j++) {
+    _gpio_onoff[j] = 0;
+    _mcb[j] = 0;
+    add(key("gpios/", j, "get_ac_warning"), GPIO_AC, j);
+    add(key("gpios/", j, "get_dc_warning"), GPIO_DC, j);
+    add(key("gpios/", j, "get_temp_warning"), GPIO_TEMP, j);
+    add(key("gpios/", j, "set_power_supply_onoff"), GPIO_ONOFF, j);
+    for (unsigned num=1; num<=12; num++) {
+      std::stringstream cmd;
+      cmd << "set_mcb" << num;
+      add(key("gpios/", j, cmd.str()), GPIO_MCB, j, num - 1);
+    }
+  }
+}
+
+MemoryBackend::~MemoryBackend()
+{
+  if (_supply) {
+    for (unsigned i=0; i<_num_ps; i++) {
+      if (_supply[i]) {
+        delete _supply[i];
+      }
+    }
+    delete[] _supply;
+  }
+  if (_ps_power) {
+    delete[] _ps_power;
+  }
+  if (_gpio_onoff) {
+    delete[] _gpio_onoff;
+  }
+  if (_mcb) {
+    delete[] _mcb;
+  }
+  pthread_mutex_destroy(&_lock);
+}
+
+std::string MemoryBackend::read_raw_value(const std::string& key)
+{
+  NameMap::const_iterator it = _names.find(key);
+  if (it != _names.end()) {
+    return it->second;
+  } else {
+    int value = read_value(key);
+    if (value < 0) {
+      return std::string("");
+    } else {
+      std::stringstream ss;
+      ss << value;
+      return ss.str();
+    }
+  }
+}
+
+int MemoryBackend::read_value(const std::string& key)
+{
+  pthread_mutex_lock(&_lock);
+  int value = load(key);
+  pthread_mutex_unlock(&_lock);
+  return value;
+}
+
+bool MemoryBackend::write_value(unsigned value, const std::string& key)
+{
+  pthread_mutex_lock(&_lock);
+  bool result = store(value, key);
+  pthread_mutex_unlock(&_lock);
+  return result;
+}
+
+bool MemoryBackend::exists(const std::string& key)
+{
+  // a key ending in a separator names a device, so match anything under it
+  RegisterMap::const_iterator reg = _regs.lower_bound(key);
+  NameMap::const_iterator name = _names.lower_bound(key);
+  return (reg != _regs.end() && !reg->first.compare(0, key.length(), key)) ||
+         (name != _names.end() && !name->first.compare(0, key.length(), key));
+}
+
+void MemoryBackend::set_fault(unsigned id, unsigned fault)
+{
+  if (id < _num_ps) {
+    pthread_mutex_lock(&_lock);
+    _supply[id]->set_fault(fault);
+    pthread_mutex_unlock(&_lock);
+  }
+}
+
+int MemoryBackend::load(const std::string& key)
+{
+  RegisterMap::const_iterator it = _regs.find(key);
+  if (it == _regs.end()) {
+    return -1;
+  }
+
+  const Register& reg = it->second;
+  switch (reg.kind) {
+  case PS_POWER:
+    return _ps_power[reg.id];
+  case PS_VOLT:
+    return _supply[reg.id]->get_voltage();
+  case PS_CURR:
+    return _supply[reg.id]->get_current(num_mcb_on(reg.id));
+  case PS_TEMP:
+    _supply[reg.id]->update(num_mcb_on(reg.id));
+    return _supply[reg.id]->get_temp();
+  case GPIO_ONOFF:
+    return _gpio_onoff[reg.id];
+  case GPIO_DC:
+    // the board without a supply of its own never sees dc
+    return reg.id < _num_ps ? _supply[reg.id]->get_dc_warning() : 1;
+  case GPIO_AC:
+    return reg.id < _num_ps ? _supply[reg.id]->get_ac_warning() : 0;
+  case GPIO_TEMP:
+    if (reg.id < _num_ps) {
+      _supply[reg.id]->update(num_mcb_on(reg.id));
+      return _supply[reg.id]->get_temp_warning();
+    } else {
+      return 0;
+    }
+  case GPIO_MCB:
+    return (_mcb[reg.id] >> reg.bit) & 1;
+  case GFM_FLOW:
+  case FAN_INPUT:
+    // add a little bit of noise around the nominal reading
+    return reg.value + (int) (reg.value * 0.01 * std::sin(Deadline::now() + reg.id));
+  default:
+    return reg.value;
+  }
+}
+
+bool MemoryBackend::store(unsigned value, const std::string& key)
+{
+  RegisterMap::iterator it = _regs.find(key);
+  if (it == _regs.end()) {
+    return false;
+  }
+
+  Register& reg = it->second;
+  switch (reg.kind) {
+  case STATIC:
+    reg.value = value;
+    return true;
+  case PS_POWER:
+    _ps_power[reg.id] = value;
+    update_supply(reg.id);
+    return true;
+  case GPIO_ONOFF:
+    _gpio_onoff[reg.id] = value;
+    update_supply(reg.id);
+    return true;
+  case GPIO_MCB:
+    _mcb[reg.id] = (_mcb[reg.id] & ~(1U<<reg.bit)) | ((value&1)<<reg.bit);
+    if (reg.id < _num_ps) {
+      // let the supply see the new load straight away
+      _supply[reg.id]->update(num_mcb_on(reg.id));
+    }
+    return true;
+  default:
+    // the measured values can't be written
+    return false;
+  }
+}
+
+void MemoryBackend::add(std::string key, Kind kind, unsigned id, unsigned bit, int value)
+{
+  Register reg = { kind, id, bit, value };
+  _regs[key] = reg;
+}
+
+void MemoryBackend::add_name(std::string key, std::string name)
+{
+  _names[key] = name;
+}
+
+void MemoryBackend::update_supply(unsigned id)
+{
+  // the supply output can be switched from either the hwmon or the gpio
+  if (id < _num_ps) {
+    bool on = _ps_power[id] || (id < _num_gpios && _gpio_onoff[id]);
+    _supply[id]->set_power(on);
+  }
+}
+
+unsigned MemoryBackend::num_mcb_on(unsigned id) const
+{
+  unsigned non = 0;
+  if (id < _num_gpios) {
+    for (unsigned i=0; i<12; i++) {
+      non += (_mcb[id]>>i)&1;
+    }
+  }
+  return non;
+}
+
+std::string MemoryBackend::key(std::string dev, int id, std::string cmd)
+{
+  std::stringstream key;
+  key << dev;
+  if (id >= 0) key << id;
+  key << '/' << cmd;
+  return key.str();
+}
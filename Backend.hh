@@ -0,0 +1,91 @@
+#ifndef Pds_Jungfrau_Backend_hh
+#define Pds_Jungfrau_Backend_hh
+
+#include <pthread.h>
+#include <map>
+#include <string>
+
+namespace Pds {
+  namespace Jungfrau {
+    class SupplyModel;
+
+    class Backend {
+    public:
+      virtual ~Backend();
+      virtual std::string read_raw_value(const std::string& key) = 0;
+      virtual int read_value(const std::string& key) = 0;
+      virtual bool write_value(unsigned value, const std::string& key) = 0;
+      virtual bool exists(const std::string& key) = 0;
+
+    protected:
+      Backend();
+    };
+
+    class SysfsBackend : public Backend {
+    public:
+      SysfsBackend(std::string path);
+      virtual ~SysfsBackend();
+      virtual std::string read_raw_value(const std::string& key);
+      virtual int read_value(const std::string& key);
+      virtual bool write_value(unsigned value, const std::string& key);
+      virtual bool exists(const std::string& key);
+
+    private:
+      std::string filename(const std::string& key) const;
+
+    private:
+      const char  _sep;
+      std::string _path;
+    };
+
+    class MemoryBackend : public Backend {
+    public:
+      MemoryBackend(const unsigned num_ps,
+                    const unsigned num_gpios,
+                    const unsigned num_gfm,
+                    const unsigned num_fan,
+                    double tau_on=0.1,
+                    double tau_off=0.5);
+      virtual ~MemoryBackend();
+      virtual std::string read_raw_value(const std::string& key);
+      virtual int read_value(const std::string& key);
+      virtual bool write_value(unsigned value, const std::string& key);
+      virtual bool exists(const std::string& key);
+      void set_fault(unsigned id, unsigned fault);
+
+    private:
+      enum Kind { STATIC, PS_POWER, PS_VOLT, PS_CURR, PS_TEMP,
+                  GPIO_ONOFF, GPIO_DC, GPIO_AC, GPIO_TEMP, GPIO_MCB,
+                  GFM_FLOW, FAN_INPUT };
+      struct Register {
+        Kind     kind;
+        unsigned id;
+        unsigned bit;
+        int      value;
+      };
+      typedef std::map<std::string, Register> RegisterMap;
+      typedef std::map<std::string, std::string> NameMap;
+
+      int load(const std::string& key);
+      bool store(unsigned value, const std::string& key);
+      void add(std::string key, Kind kind, unsigned id=0, unsigned bit=0, int value=0);
+      void add_name(std::string key, std::string name);
+      void update_supply(unsigned id);
+      unsigned num_mcb_on(unsigned id) const;
+      static std::string key(std::string dev, int id, std::string cmd);
+
+    private:
+      const unsigned _num_ps;
+      const unsigned _num_gpios;
+      unsigned*      _ps_power;
+      unsigned*      _gpio_onoff;
+      unsigned*      _mcb;
+      SupplyModel**  _supply;
+      pthread_mutex_t _lock;
+      RegisterMap    _regs;
+      NameMap        _names;
+    };
+  }
+}
+
+#endif
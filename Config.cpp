@@ -0,0 +1,76 @@
+#include "Config.hh"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace Pds::Jungfrau;
+
+Config::Config() :
+  name("JF4MD-CTRL"),
+  conns(3),
+  boards(1),
+  gfms(0),
+  fans(1),
+  fixed(false)
+{}
+
+bool Config::load()
+{
+  if (file.empty()) {
+    return true;
+  }
+
+  std::ifstream in(file.c_str());
+  if (!in.is_open()) {
+    std::cerr << "Error: unable to open config file " << file << std::endl;
+    return false;
+  }
+
+  // nothing is changed unless the whole file is good
+  Config config(*this);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream ss(line);
+    std::string key;
+    std::string value;
+    if (!(ss >> key) || key[0] == '#') continue;
+    std::getline(ss >> std::ws, value);
+    value.erase(value.find_last_not_of(" \t\r") + 1);
+    char* end = NULL;
+    unsigned long ivalue = std::strtoul(value.c_str(), &end, 0);
+    if (value.empty()) {
+      std::cerr << "Error: missing value in config file line: " << line << std::endl;
+      return false;
+    } else if (!key.compare("name")) {
+      config.name = value;
+    } else if (*end != '\0') {
+      std::cerr << "Error: invalid value in config file line: " << line << std::endl;
+      return false;
+    } else if (!key.compare("conn")) {
+      config.conns = ivalue;
+    } else if (!key.compare("boards")) {
+      config.boards = ivalue;
+    } else if (!key.compare("gfms")) {
+      config.gfms = ivalue;
+    } else if (!key.compare("fans")) {
+      config.fans = ivalue;
+    } else {
+      std::cerr << "Error: unknown option in config file line: " << line << std::endl;
+      return false;
+    }
+  }
+
+  if (!config.conns) {
+    std::cerr << "Error: config file " << file << " allows no connections" << std::endl;
+    return false;
+  } else if (fixed && (config.boards != boards || config.gfms != gfms || config.fans != fans)) {
+    // the simulated devices are only made once, at startup
+    std::cerr << "Error: config file " << file << " changes the layout of the simulated hardware" << std::endl;
+    return false;
+  }
+
+  *this = config;
+  return true;
+}
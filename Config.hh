@@ -0,0 +1,30 @@
+#ifndef Pds_Jungfrau_Config_hh
+#define Pds_Jungfrau_Config_hh
+
+#include <string>
+
+namespace Pds {
+  namespace Jungfrau {
+    /*
+     * The detector layout and connection limit, from the command line and
+     * optionally a file of '<option> <value>' lines that is read again on
+     * SIGHUP. Options the file leaves out keep their current value. A
+     * fixed layout, as with the simulated hardware, can't be changed by a
+     * reload.
+     */
+    struct Config {
+      Config();
+      bool load();
+
+      std::string file;
+      std::string name;
+      unsigned    conns;
+      unsigned    boards;
+      unsigned    gfms;
+      unsigned    fans;
+      bool        fixed;
+    };
+  }
+}
+
+#endif
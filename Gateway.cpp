@@ -0,0 +1,508 @@
+#include "Gateway.hh"
+#include "Timer.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace Pds::Jungfrau;
+
+Chassis::Chassis(unsigned id, std::string host, std::string port) :
+  _id(id),
+  _host(host),
+  _port(port),
+  _fd(-1),
+  _connecting(false),
+  _expected(0),
+  _tag(0)
+{}
+
+Chassis::~Chassis()
+{
+  close();
+}
+
+std::string Chassis::name() const
+{
+  std::stringstream name;
+  name << "C" << _id << " (" << _host << ":" << _port << ")";
+  return name.str();
+}
+
+bool Chassis::open()
+{
+  if (_fd >= 0) {
+    return true;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo* addr = NULL;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = ::getaddrinfo(_host.c_str(), _port.c_str(), &hints, &addr);
+  if (err) {
+    std::cerr << "Error: unable to resolve " << name() << ": "
+              << gai_strerror(err) << std::endl;
+    return false;
+  }
+
+  _fd = ::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (_fd < 0) {
+    std::perror("Error: chassis socket creation failed");
+  } else {
+    // connect in the background so a dead chassis can't stall the others
+    ::fcntl(_fd, F_SETFL, ::fcntl(_fd, F_GETFL) | O_NONBLOCK);
+    if (::connect(_fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+      std::cerr << "Error: unable to connect to " << name() << ": "
+                << std::strerror(errno) << std::endl;
+      ::close(_fd);
+      _fd = -1;
+    } else {
+      _connecting = true;
+    }
+  }
+  ::freeaddrinfo(addr);
+
+  return _fd >= 0;
+}
+
+void Chassis::close()
+{
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _connecting = false;
+  _expected = 0;
+  _out.clear();
+  _in.clear();
+  _replies.clear();
+}
+
+bool Chassis::busy() const
+{
+  return _fd >= 0 && (_connecting || !_out.empty() || _expected > 0);
+}
+
+int Chassis::fd() const
+{
+  return _fd;
+}
+
+short Chassis::events() const
+{
+  return (_connecting || !_out.empty()) ? (POLLIN | POLLOUT) : POLLIN;
+}
+
+void Chassis::queue(const std::string& cmd)
+{
+  std::stringstream tagged;
+  // tag the command so even the setters are acknowledged
+  tagged << '#' << ++_tag << ' ' << cmd << '\n';
+  _replies.clear();
+  _out += tagged.str();
+  _expected++;
+}
+
+void Chassis::process(short revents)
+{
+  if (_connecting && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (::getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+      std::cerr << "Error: unable to connect to " << name() << ": "
+                << std::strerror(err ? err : errno) << std::endl;
+      close();
+      return;
+    }
+    _connecting = false;
+  }
+
+  if (revents & POLLIN) {
+    receive();
+  }
+
+  if (_fd >= 0 && !_connecting && !_out.empty() && (revents & POLLOUT)) {
+    ssize_t nsent = ::send(_fd, _out.c_str(), _out.length(), MSG_NOSIGNAL);
+    if (nsent < 0) {
+      if (errno != EAGAIN) {
+        std::cerr << "Error: send to " << name() << " failed: "
+                  << std::strerror(errno) << std::endl;
+        close();
+      }
+    } else {
+      _out.erase(0, nsent);
+    }
+  }
+}
+
+void Chassis::receive()
+{
+  char buf[1024];
+  ssize_t nread = ::recv(_fd, buf, sizeof(buf), 0);
+  if (nread > 0) {
+    _in.append(buf, nread);
+    size_t pos;
+    std::stringstream tag;
+    tag << '#' << _tag << ' ';
+    while ((pos = _in.find('\n')) != std::string::npos) {
+      // anything without the latest tag doesn't belong to this command
+      if (!_in.compare(0, tag.str().length(), tag.str())) {
+        _replies.push_back(_in.substr(tag.str().length(), pos - tag.str().length()));
+        if (_expected > 0) _expected--;
+      }
+      _in.erase(0, pos + 1);
+    }
+  } else if (nread == 0 || errno != EAGAIN) {
+    std::cerr << "Error: lost connection to " << name() << std::endl;
+    close();
+  }
+}
+
+bool Chassis::reply(std::string& line)
+{
+  if (_replies.empty()) {
+    return false;
+  } else {
+    line = _replies.front();
+    _replies.pop_front();
+    return true;
+  }
+}
+
+
+Gateway::Gateway(std::string name,
+                 const std::vector<std::string>& chassis,
+                 const unsigned stagger) :
+  _name(name),
+  _stagger(stagger)
+{
+  for (unsigned i=0; i<chassis.size(); i++) {
+    // each entry is <host>[:<port>]
+    size_t cpos = chassis[i].rfind(':');
+    if (cpos == std::string::npos) {
+      _chassis.push_back(new Chassis(i, chassis[i], "32415"));
+    } else {
+      _chassis.push_back(new Chassis(i, chassis[i].substr(0, cpos), chassis[i].substr(cpos+1)));
+    }
+  }
+}
+
+Gateway::~Gateway()
+{
+  for (unsigned i=0; i<_chassis.size(); i++) {
+    delete _chassis[i];
+  }
+}
+
+std::string Gateway::run(const std::string& cmd)
+{
+  size_t cpos = cmd.find(":");
+  size_t vpos = cmd.find(" ");
+  std::string base = cmd.substr(0, vpos);
+  std::string value = vpos == std::string::npos ? std::string("") : cmd.substr(vpos+1);
+
+  if (cpos != std::string::npos && cpos < vpos && cmd[0] == 'C') {
+    return forward(cmd.substr(0, cpos), cmd.substr(cpos+1));
+  } else if (!cmd.compare("*IDN?")) {
+    return _name + '\n';
+  } else if (!cmd.compare("STATE?")) {
+    return state();
+  } else if (!cmd.compare("MODULES?")) {
+    return modules();
+  } else if (!cmd.compare("BLOCK?")) {
+    return block();
+  } else if (!cmd.compare("ON")) {
+    return sequence(true, false);
+  } else if (!cmd.compare("OFF")) {
+    return sequence(false, false);
+  } else if (!cmd.compare("TOGGLE")) {
+    return sequence(state().compare("ON\n") != 0, false);
+  } else if (!base.compare("STATE") && !value.compare("ON")) {
+    return sequence(true, true);
+  } else if (!base.compare("STATE") && !value.compare("OFF")) {
+    return sequence(false, true);
+  } else if (!value.empty() &&
+             (!base.compare("INTERVAL") || !base.compare("TIMEOUT") ||
+              !base.compare("BUDGET") || !base.compare("BLOCK"))) {
+    // settings that apply to the whole detector go to every chassis
+    std::vector<std::string> replies;
+    bool result = exchange(cmd, replies, 0, QUERY_TIMEOUT);
+    for (unsigned i=0; i<replies.size(); i++) {
+      // pass on why a chassis turned the setting down
+      if (is_error(replies[i])) return replies[i] + '\n';
+    }
+    if (!result) {
+      std::cerr << "Error: failed to send " << cmd << " to every chassis" << std::endl;
+      return error(ERR_DEVICE);
+    }
+  } else {
+    std::cerr << "Error: command needs a chassis prefix in gateway mode: "
+              << cmd << std::endl;
+    return error(ERR_COMMAND);
+  }
+
+  return std::string("");
+}
+
+bool Gateway::cached(const std::string& cmd, std::string& reply)
+{
+  if (!cmd.compare("*IDN?")) {
+    reply = _name + '\n';
+    return true;
+  } else {
+    return false;
+  }
+}
+
+void Gateway::verify()
+{
+  // the downstream servers check their own hardware
+}
+
+void Gateway::metrics(std::string& page) const
+{
+  // each chassis serves the metrics of its own hardware
+}
+
+long Gateway::step()
+{
+  // the module sequencing happens on each chassis
+  return -1;
+}
+
+void Gateway::configure(const Config& config)
+{
+  // the chassis come from the command line, so there is nothing to resize
+}
+
+bool Gateway::exchange(const std::string& cmd,
+                       std::vector<std::string>& replies,
+                       const unsigned stagger,
+                       const unsigned timeout,
+                       bool reverse)
+{
+  const unsigned nchassis = _chassis.size();
+  std::vector<bool> started(nchassis, false);
+  std::vector<pollfd> pfds;
+  std::vector<unsigned> active;
+  double begin = Deadline::now();
+  double deadline = begin + (timeout + stagger * nchassis) / 1000.0;
+  bool result = true;
+
+  replies.assign(nchassis, std::string(""));
+  while (true) {
+    double t = Deadline::now();
+    double wait = deadline - t;
+
+    // start each chassis its stagger after the previous one
+    for (unsigned n=0; n<nchassis; n++) {
+      unsigned i = reverse ? nchassis - 1 - n : n;
+      double start = begin + (n * stagger) / 1000.0;
+      if (started[i]) {
+        continue;
+      } else if (t < start) {
+        if (start - t < wait) wait = start - t;
+        break;
+      }
+      started[i] = true;
+      if (_chassis[i]->open()) {
+        _chassis[i]->queue(cmd);
+      } else {
+        result = false;
+      }
+    }
+
+    pfds.clear();
+    active.clear();
+    for (unsigned i=0; i<nchassis; i++) {
+      if (started[i] && _chassis[i]->busy()) {
+        pollfd pfd;
+        pfd.fd = _chassis[i]->fd();
+        pfd.events = _chassis[i]->events();
+        pfd.revents = 0;
+        pfds.push_back(pfd);
+        active.push_back(i);
+      }
+    }
+
+    bool pending = false;
+    for (unsigned i=0; i<nchassis; i++) {
+      if (!started[i]) pending = true;
+    }
+    if (active.empty() && !pending) {
+      break;
+    } else if (t >= deadline) {
+      for (unsigned j=0; j<active.size(); j++) {
+        std::cerr << "Error: timed out waiting for " << _chassis[active[j]]->name()
+                  << " to finish " << cmd << std::endl;
+        // drop the connection so a late reply can't be taken for the next one
+        _chassis[active[j]]->close();
+      }
+      result = false;
+      break;
+    }
+
+    // a chassis can take a while to power on, but the wait itself can't
+    // wedge, so wake up now and then to show the sequence is still going
+    progress(cmd);
+    if (wait > PROGRESS_TIMEOUT / 1000.0) wait = PROGRESS_TIMEOUT / 1000.0;
+    int npoll = ::poll(pfds.empty() ? NULL : &pfds[0], pfds.size(), (int) (wait * 1000) + 1);
+    if (npoll < 0) {
+      std::perror("Error: gateway poller failed");
+      return false;
+    }
+    for (unsigned j=0; j<active.size(); j++) {
+      if (pfds[j].revents) {
+        _chassis[active[j]]->process(pfds[j].revents);
+      }
+    }
+  }
+
+  for (unsigned i=0; i<nchassis; i++) {
+    if (!_chassis[i]->reply(replies[i])) {
+      result = false;
+    }
+  }
+
+  return result;
+}
+
+std::string Gateway::forward(const std::string& prefix, const std::string& cmd)
+{
+  char* end = NULL;
+  unsigned index = std::strtoul(prefix.substr(1).c_str(), &end, 0);
+  if (prefix.length() < 2 || *end != '\0') {
+    std::cerr << "Error: invalid chassis prefix: " << prefix << std::endl;
+    return error(ERR_INDEX);
+  } else if (index >= _chassis.size()) {
+    std::cerr << "Chassis index out-of-range: " << index << std::endl;
+    return error(ERR_INDEX);
+  } else {
+    Chassis* chassis = _chassis[index];
+    if (chassis->open()) {
+      chassis->queue(cmd);
+      double deadline = Deadline::now() + QUERY_TIMEOUT / 1000.0;
+      while (chassis->busy()) {
+        double wait = deadline - Deadline::now();
+        if (wait <= 0.0) {
+          std::cerr << "Error: timed out waiting for " << chassis->name()
+                    << " to finish " << cmd << std::endl;
+          chassis->close();
+          break;
+        }
+        pollfd pfd;
+        pfd.fd = chassis->fd();
+        pfd.events = chassis->events();
+        pfd.revents = 0;
+        if (::poll(&pfd, 1, (int) (wait * 1000) + 1) < 0) {
+          std::perror("Error: gateway poller failed");
+          break;
+        }
+        if (pfd.revents) chassis->process(pfd.revents);
+      }
+      std::string reply;
+      if (chassis->reply(reply)) {
+        // the acknowledgement of a setter isn't passed on, but an error is
+        if (expects_reply(cmd) || is_error(reply)) {
+          return reply + '\n';
+        } else {
+          return std::string("");
+        }
+      }
+    }
+  }
+
+  // the chassis couldn't be reached or didn't answer in time
+  return error(ERR_DEVICE);
+}
+
+std::string Gateway::state()
+{
+  std::vector<std::string> replies;
+  if (!exchange("STATE?", replies, 0, QUERY_TIMEOUT)) {
+    return std::string("ERROR\n");
+  } else {
+    return aggregate(replies);
+  }
+}
+
+std::string Gateway::sequence(bool on, bool verbose)
+{
+  std::vector<std::string> replies;
+  // power up in order and down in reverse to spread out the inrush
+  bool result = exchange(on ? "STATE ON" : "STATE OFF", replies,
+                         _stagger, SEQUENCE_TIMEOUT, !on);
+  // a chassis that answers ERROR or the wrong state didn't make it either
+  std::string state = result ? aggregate(replies) : std::string("ERROR\n");
+  if (state.compare(on ? "ON\n" : "OFF\n")) {
+    std::cerr << "Error: power " << (on ? "on" : "off")
+              << " did not complete on every chassis" << std::endl;
+    result = false;
+  }
+
+  if (verbose) {
+    return state;
+  } else if (!result) {
+    return error(ERR_DEVICE);
+  } else {
+    return std::string("");
+  }
+}
+
+std::string Gateway::modules()
+{
+  std::vector<std::string> replies;
+  if (exchange("MODULES?", replies, 0, QUERY_TIMEOUT)) {
+    long total = 0;
+    for (unsigned i=0; i<replies.size(); i++) {
+      total += std::strtol(replies[i].c_str(), NULL, 0);
+    }
+    std::stringstream reply;
+    reply << total << '\n';
+    return reply.str();
+  } else {
+    std::cerr << "Error: unable to count the modules of every chassis" << std::endl;
+    return error(ERR_DEVICE);
+  }
+}
+
+std::string Gateway::block()
+{
+  std::vector<std::string> replies;
+  if (exchange("BLOCK?", replies, 0, QUERY_TIMEOUT)) {
+    for (unsigned i=0; i<replies.size(); i++) {
+      if (replies[i].compare("NO")) {
+        return std::string("YES\n");
+      }
+    }
+    return std::string("NO\n");
+  } else {
+    // can't say it is safe if a chassis doesn't answer
+    return std::string("YES\n");
+  }
+}
+
+std::string Gateway::aggregate(const std::vector<std::string>& replies)
+{
+  // the detector is only on or off if every chassis agrees
+  std::string state = replies.empty() ? std::string("ERROR") : replies[0];
+  for (unsigned i=1; i<replies.size(); i++) {
+    if (replies[i].compare(state)) {
+      state = "ERROR";
+    }
+  }
+  if (state.compare("ON") && state.compare("OFF")) {
+    state = "ERROR";
+  }
+  return state + '\n';
+}
@@ -0,0 +1,84 @@
+#ifndef Pds_Jungfrau_Gateway_hh
+#define Pds_Jungfrau_Gateway_hh
+
+#include "Reader.hh"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace Pds {
+  namespace Jungfrau {
+    class Chassis {
+    public:
+      Chassis(unsigned id, std::string host, std::string port);
+      ~Chassis();
+      std::string name() const;
+      bool open();
+      void close();
+      bool busy() const;
+      int fd() const;
+      short events() const;
+      void queue(const std::string& cmd);
+      void process(short revents);
+      bool reply(std::string& line);
+
+    private:
+      void receive();
+
+    private:
+      const unsigned          _id;
+      std::string             _host;
+      std::string             _port;
+      int                     _fd;
+      bool                    _connecting;
+      unsigned                _expected;
+      unsigned long           _tag;
+      std::string             _out;
+      std::string             _in;
+      std::deque<std::string> _replies;
+    };
+
+    /*
+     * Runs the protocol against several downstream powerctrl servers,
+     * one per chassis of a larger detector.
+     */
+    class Gateway : public Runner {
+    public:
+      Gateway(std::string name,
+              const std::vector<std::string>& chassis,
+              const unsigned stagger);
+      virtual ~Gateway();
+      virtual std::string run(const std::string& cmd);
+      virtual bool cached(const std::string& cmd, std::string& reply);
+      virtual void verify();
+      virtual void metrics(std::string& page) const;
+      virtual long step();
+      virtual void configure(const Config& config);
+
+      static const unsigned QUERY_TIMEOUT = 3500;     // ms
+      static const unsigned SEQUENCE_TIMEOUT = 60000; // ms
+      static const unsigned PROGRESS_TIMEOUT = 1000;  // ms
+
+    private:
+      bool exchange(const std::string& cmd,
+                    std::vector<std::string>& replies,
+                    const unsigned stagger,
+                    const unsigned timeout,
+                    bool reverse=false);
+      std::string forward(const std::string& prefix, const std::string& cmd);
+      std::string state();
+      std::string sequence(bool on, bool verbose);
+      std::string modules();
+      std::string block();
+      static std::string aggregate(const std::vector<std::string>& replies);
+
+    private:
+      std::string           _name;
+      const unsigned        _stagger;
+      std::vector<Chassis*> _chassis;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,175 @@
+#include "Listener.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+using namespace Pds::Jungfrau;
+
+Listener::Listener() :
+  _fd(-1)
+{}
+
+Listener::~Listener()
+{
+  close();
+}
+
+int Listener::fd() const
+{
+  return _fd;
+}
+
+int Listener::accept()
+{
+  return ::accept(_fd, NULL, NULL);
+}
+
+void Listener::close()
+{
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+bool Listener::listen(const void* addr, unsigned addrlen, const unsigned backlog)
+{
+  if (::bind(_fd, (const struct sockaddr *) addr, addrlen) < 0) {
+    std::perror(("Error: bind failed for " + name()).c_str());
+  } else if (::listen(_fd, backlog) < 0) {
+    std::perror(("Error: listen failed for " + name()).c_str());
+  } else {
+    return true;
+  }
+  close();
+  return false;
+}
+
+Listener* Listener::create(const std::string& spec)
+{
+  size_t cpos = spec.find(':');
+  if (cpos == std::string::npos) {
+    return NULL;
+  }
+  std::string type = spec.substr(0, cpos);
+  std::string addr = spec.substr(cpos+1);
+  if (addr.empty()) {
+    return NULL;
+  } else if (type == "tcp") {
+    return new TcpListener(std::strtoul(addr.c_str(), NULL, 0));
+  } else if (type == "tcp6") {
+    return new TcpListener(std::strtoul(addr.c_str(), NULL, 0), true);
+  } else if (type == "unix") {
+    return new UnixListener(addr);
+  } else {
+    return NULL;
+  }
+}
+
+TcpListener::TcpListener(const unsigned port, bool ipv6) :
+  _port(port),
+  _ipv6(ipv6)
+{}
+
+TcpListener::~TcpListener()
+{}
+
+std::string TcpListener::name() const
+{
+  std::ostringstream name;
+  name << (_ipv6 ? "tcp6:" : "tcp:") << _port;
+  return name.str();
+}
+
+bool TcpListener::open(const unsigned backlog)
+{
+  int opt = 1;
+
+  _fd = ::socket(_ipv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+  if (_fd < 0) {
+    std::perror(("Error: socket creation failed for " + name()).c_str());
+    return false;
+  }
+  if (::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    std::perror(("Error: setsockopt failed for " + name()).c_str());
+    close();
+    return false;
+  }
+
+  if (_ipv6) {
+    struct sockaddr_in6 address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(_port);
+    // leave the ipv4 addresses to a tcp listener on the same port
+    if (::setsockopt(_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt)) < 0) {
+      std::perror(("Error: setsockopt IPV6_V6ONLY failed for " + name()).c_str());
+      close();
+      return false;
+    }
+    return listen(&address, sizeof(address), backlog);
+  } else {
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(_port);
+    return listen(&address, sizeof(address), backlog);
+  }
+}
+
+bool TcpListener::tcp() const
+{
+  return true;
+}
+
+UnixListener::UnixListener(std::string path) :
+  _path(path)
+{}
+
+UnixListener::~UnixListener()
+{
+  if (_fd >= 0) {
+    ::unlink(_path.c_str());
+  }
+}
+
+std::string UnixListener::name() const
+{
+  return "unix:" + _path;
+}
+
+bool UnixListener::open(const unsigned backlog)
+{
+  struct sockaddr_un address;
+
+  if (_path.length() >= sizeof(address.sun_path)) {
+    std::cerr << "Error: socket path is too long for " << name() << std::endl;
+    return false;
+  }
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, _path.c_str());
+
+  _fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_fd < 0) {
+    std::perror(("Error: socket creation failed for " + name()).c_str());
+    return false;
+  }
+  // a socket left behind by an earlier run would make the bind fail
+  ::unlink(_path.c_str());
+  return listen(&address, sizeof(address), backlog);
+}
+
+bool UnixListener::tcp() const
+{
+  return false;
+}
@@ -0,0 +1,59 @@
+#ifndef Pds_Jungfrau_Listener_hh
+#define Pds_Jungfrau_Listener_hh
+
+#include <string>
+
+namespace Pds {
+  namespace Jungfrau {
+    /*
+     * A socket the server accepts control connections on. Listeners are
+     * made from a spec such as tcp:32415, tcp6:32415 or unix:/var/run/powerctrl.
+     */
+    class Listener {
+    public:
+      virtual ~Listener();
+      virtual std::string name() const = 0;
+      virtual bool open(const unsigned backlog) = 0;
+      virtual bool tcp() const = 0;
+      int fd() const;
+      int accept();
+      void close();
+
+      static Listener* create(const std::string& spec);
+
+    protected:
+      Listener();
+      bool listen(const void* addr, unsigned addrlen, const unsigned backlog);
+
+    protected:
+      int _fd;
+    };
+
+    class TcpListener : public Listener {
+    public:
+      TcpListener(const unsigned port, bool ipv6=false);
+      virtual ~TcpListener();
+      virtual std::string name() const;
+      virtual bool open(const unsigned backlog);
+      virtual bool tcp() const;
+
+    private:
+      const unsigned _port;
+      const bool     _ipv6;
+    };
+
+    class UnixListener : public Listener {
+    public:
+      UnixListener(std::string path);
+      virtual ~UnixListener();
+      virtual std::string name() const;
+      virtual bool open(const unsigned backlog);
+      virtual bool tcp() const;
+
+    private:
+      std::string _path;
+    };
+  }
+}
+
+#endif
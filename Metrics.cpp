@@ -0,0 +1,227 @@
+#include "Metrics.hh"
+#include "Reader.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace Pds::Jungfrau;
+
+Counters::Counters() :
+  accepted(0),
+  refused(0),
+  queued(0),
+  evicted(0),
+  commands(0),
+  cached(0),
+  open(0)
+{}
+
+Metrics::Metrics(const Runner* cmd, const Counters* counters) :
+  _cmd(cmd),
+  _counters(counters),
+  _fd(-1),
+  _scrapes(0)
+{
+  for (unsigned i=0; i<MAX_SCRAPERS; i++) {
+    _scrapers[i].fd = -1;
+    _scrapers[i].sent = 0;
+  }
+}
+
+Metrics::~Metrics()
+{
+  for (unsigned i=0; i<MAX_SCRAPERS; i++) {
+    if (_scrapers[i].fd >= 0) {
+      ::close(_scrapers[i].fd);
+    }
+  }
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+}
+
+bool Metrics::listen(const unsigned port)
+{
+  struct sockaddr_in address;
+  int opt = 1;
+
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port = htons(port);
+
+  _fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (_fd < 0) {
+    std::perror("Error: metrics socket creation failed");
+    return false;
+  }
+  if (::setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    std::perror("Error: setsockopt failed on metrics socket");
+  } else if (::bind(_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    std::perror("Error: bind failed for metrics socket");
+  } else if (::listen(_fd, MAX_SCRAPERS) < 0) {
+    std::perror("Error: listen failed for metrics socket");
+  } else {
+    return true;
+  }
+  ::close(_fd);
+  _fd = -1;
+  return false;
+}
+
+void Metrics::setup(pollfd* pfds) const
+{
+  pfds[0].fd = _fd;
+  for (unsigned i=0; i<NFDS; i++) {
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+  for (unsigned i=0; i<MAX_SCRAPERS; i++) {
+    pfds[i+1].fd = _scrapers[i].fd;
+  }
+}
+
+void Metrics::process(pollfd* pfds)
+{
+  for (unsigned i=0; i<MAX_SCRAPERS; i++) {
+    Scraper& scraper = _scrapers[i];
+    pollfd& pfd = pfds[i+1];
+    if (scraper.fd < 0) continue;
+    bool open = !(pfd.revents & (POLLERR | POLLHUP));
+    if (open && (pfd.revents & POLLIN)) {
+      open = receive(scraper);
+    }
+    // the connection is closed once the whole page is out
+    if (open && !scraper.out.empty()) {
+      open = send(scraper, pfd);
+    }
+    if (!open) {
+      close(scraper, pfd);
+    }
+  }
+
+  if (pfds[0].revents & POLLIN) {
+    accept(pfds);
+  }
+}
+
+void Metrics::accept(pollfd* pfds)
+{
+  int fd = ::accept(_fd, NULL, NULL);
+  if (fd < 0) {
+    std::perror("Error: metrics accept failed");
+    return;
+  }
+
+  for (unsigned i=0; i<MAX_SCRAPERS; i++) {
+    if (_scrapers[i].fd < 0) {
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+      _scrapers[i].fd = fd;
+      _scrapers[i].sent = 0;
+      _scrapers[i].in.clear();
+      _scrapers[i].out.clear();
+      pfds[i+1].fd = fd;
+      pfds[i+1].events = POLLIN;
+      return;
+    }
+  }
+  // too many scrapes at once, let the monitoring retry
+  ::close(fd);
+}
+
+bool Metrics::receive(Scraper& scraper)
+{
+  char buf[512];
+  int nread = ::recv(scraper.fd, buf, sizeof(buf), 0);
+  if (nread <= 0) {
+    return nread < 0 && errno == EAGAIN;
+  }
+  scraper.in.append(buf, nread);
+  if (scraper.in.length() > MAX_REQUEST) {
+    return false;
+  }
+
+  // the whole request header has to be in before answering
+  if (scraper.out.empty() &&
+      (scraper.in.find("\r\n\r\n") != std::string::npos ||
+       scraper.in.find("\n\n") != std::string::npos)) {
+    char header[256];
+    if (scraper.in.compare(0, 4, "GET ")) {
+      std::snprintf(header, sizeof(header),
+                    "HTTP/1.0 405 Method Not Allowed\r\n"
+                    "Content-Length: 0\r\n"
+                    "Connection: close\r\n\r\n");
+      scraper.out = header;
+    } else {
+      render();
+      std::snprintf(header, sizeof(header),
+                    "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %lu\r\n"
+                    "Connection: close\r\n\r\n",
+                    (unsigned long) _page.length());
+      scraper.out = header;
+      scraper.out += _page;
+    }
+    scraper.sent = 0;
+  }
+
+  return true;
+}
+
+bool Metrics::send(Scraper& scraper, pollfd& pfd)
+{
+  int nsent = ::send(scraper.fd, scraper.out.data() + scraper.sent,
+                     scraper.out.length() - scraper.sent, MSG_NOSIGNAL);
+  if (nsent < 0 && errno != EAGAIN) {
+    return false;
+  } else if (nsent > 0) {
+    scraper.sent += nsent;
+  }
+  // wait for room in the socket for whatever is left
+  pfd.events = POLLOUT;
+  return scraper.sent < scraper.out.length();
+}
+
+void Metrics::close(Scraper& scraper, pollfd& pfd)
+{
+  ::close(scraper.fd);
+  scraper.fd = -1;
+  scraper.in.clear();
+  scraper.out.clear();
+  pfd.fd = -1;
+}
+
+void Metrics::render()
+{
+  char buf[128];
+
+  // reuse the page so a scrape doesn't have to grow it again
+  _page.clear();
+  _cmd->metrics(_page);
+
+  std::snprintf(buf, sizeof(buf),
+                "powerctrl_connections_open %u\n"
+                "powerctrl_connections_accepted_total %lu\n",
+                _counters->open, _counters->accepted);
+  _page += buf;
+  std::snprintf(buf, sizeof(buf),
+                "powerctrl_connections_refused_total %lu\n"
+                "powerctrl_commands_total %lu\n",
+                _counters->refused, _counters->commands);
+  _page += buf;
+  std::snprintf(buf, sizeof(buf),
+                "powerctrl_connections_queued_total %lu\n"
+                "powerctrl_connections_evicted_total %lu\n",
+                _counters->queued, _counters->evicted);
+  _page += buf;
+  std::snprintf(buf, sizeof(buf),
+                "powerctrl_commands_cached_total %lu\n"
+                "powerctrl_scrapes_total %lu\n",
+                _counters->cached, ++_scrapes);
+  _page += buf;
+}
@@ -0,0 +1,63 @@
+#ifndef Pds_Jungfrau_Metrics_hh
+#define Pds_Jungfrau_Metrics_hh
+
+#include <poll.h>
+#include <string>
+
+namespace Pds {
+  namespace Jungfrau {
+    class Runner;
+
+    /*
+     * Counters kept by the server about its own connections and commands.
+     */
+    struct Counters {
+      Counters();
+      unsigned long accepted;
+      unsigned long refused;
+      unsigned long queued;
+      unsigned long evicted;
+      unsigned long commands;
+      unsigned long cached;
+      unsigned      open;
+    };
+
+    /*
+     * Serves the last hardware snapshot and the server counters as a
+     * plain-text metrics page over HTTP on a port of its own.
+     */
+    class Metrics {
+    public:
+      enum { MAX_SCRAPERS = 4, NFDS = MAX_SCRAPERS + 1, MAX_REQUEST = 4096 };
+      Metrics(const Runner* cmd, const Counters* counters);
+      ~Metrics();
+      bool listen(const unsigned port);
+      void setup(pollfd* pfds) const;
+      void process(pollfd* pfds);
+
+    private:
+      struct Scraper {
+        int         fd;
+        size_t      sent;
+        std::string in;
+        std::string out;
+      };
+
+      void accept(pollfd* pfds);
+      bool receive(Scraper& scraper);
+      bool send(Scraper& scraper, pollfd& pfd);
+      void close(Scraper& scraper, pollfd& pfd);
+      void render();
+
+    private:
+      const Runner*   _cmd;
+      const Counters* _counters;
+      int             _fd;
+      unsigned long   _scrapes;
+      std::string     _page;
+      Scraper         _scrapers[MAX_SCRAPERS];
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef Pds_Jungfrau_Queue_hh
+#define Pds_Jungfrau_Queue_hh
+
+namespace Pds {
+  namespace Jungfrau {
+    /*
+     * Lock-free ring buffer for exactly one producer thread and one
+     * consumer thread. The capacity is rounded up to a power of two.
+     */
+    template <typename T>
+    class Queue {
+    public:
+      Queue(unsigned capacity) :
+        _mask(round(capacity) - 1),
+        _items(new T[_mask + 1]),
+        _head(0),
+        _tail(0)
+      {}
+
+      ~Queue()
+      {
+        delete[] _items;
+      }
+
+      unsigned capacity() const
+      {
+        return _mask + 1;
+      }
+
+      bool push(const T& item)
+      {
+        unsigned tail = _tail;
+        if (tail - _head > _mask) {
+          return false;
+        }
+        _items[tail & _mask] = item;
+        // publish the item before moving the tail
+        __sync_synchronize();
+        _tail = tail + 1;
+        return true;
+      }
+
+      bool pop(T& item)
+      {
+        unsigned head = _head;
+        if (head == _tail) {
+          return false;
+        }
+        __sync_synchronize();
+        item = _items[head & _mask];
+        // finish reading the item before releasing the slot
+        __sync_synchronize();
+        _head = head + 1;
+        return true;
+      }
+
+      bool empty() const
+      {
+        return _head == _tail;
+      }
+
+    private:
+      static unsigned round(unsigned capacity)
+      {
+        unsigned size = 1;
+        while (size < capacity) size <<= 1;
+        return size;
+      }
+
+    private:
+      const unsigned    _mask;
+      T*                _items;
+      volatile unsigned _head;
+      volatile unsigned _tail;
+    };
+  }
+}
+
+#endif
@@ -1,14 +1,22 @@
 #include "Reader.hh"
+#include "Config.hh"
+#include "Backend.hh"
+#include "Timer.hh"
+#include "Watchdog.hh"
 
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
 #include <ctime>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <limits>
 
 using namespace Pds::Jungfrau;
 
@@ -112,7 +120,8 @@ bool Lock::clear() const
 }
 
 Flag::Flag(std::string path, std::string name) :
-  File(path, name)
+  File(path, name),
+  _cached(-1)
 {}
 
 Flag::~Flag()
@@ -120,17 +129,30 @@ Flag::~Flag()
 
 bool Flag::is_set() const
 {
-  return read_flag();
+  // only go to the file when something may have changed it
+  if (_cached < 0) {
+    _cached = read_flag() ? 1 : 0;
+  }
+  return _cached > 0;
 }
 
 bool Flag::set() const
 {
-  return write_flag(true);
+  bool result = write_flag(true);
+  _cached = result ? 1 : -1;
+  return result;
 }
 
 bool Flag::clear() const
 {
-  return write_flag(false);
+  bool result = write_flag(false);
+  _cached = result ? 0 : -1;
+  return result;
+}
+
+void Flag::invalidate() const
+{
+  _cached = -1;
 }
 
 bool Flag::read_flag() const
@@ -159,174 +181,319 @@ bool Flag::write_flag(bool flag) const
   }
 }
 
+const uint32_t StateFile::MAGIC;
+const uint32_t StateFile::VERSION;
 
-Control::Control(std::string path, std::string type, std::string dev) :
-  _sep('/'),
-  _path(path),
-  _type(type),
-  _dev(dev)
+StateFile::StateFile(std::string path, std::string name) :
+  File(path, name),
+  _path(path)
 {}
 
-Control::~Control()
+StateFile::~StateFile()
 {}
 
-std::string Control::read_raw_value(std::string cmd, int id) const
+bool StateFile::load(Settings& settings) const
 {
-  std::string result;
+  uint32_t buf[64];
+  int fd = ::open(_filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      std::cerr << "Problem opening state file " << _filename << ": "
+                << std::strerror(errno) << std::endl;
+    }
+    return false;
+  }
+  ssize_t nread = ::read(fd, buf, sizeof(buf));
+  ::close(fd);
 
-  // read the file
-  std::ifstream file(filename(cmd, id).c_str());
-  if (file.is_open()) {
-    file >> result;
-    file.close();
+  // magic, version, number of gpios, pause, timeout, budget, masks and checksum
+  if (nread < (ssize_t) (6 * sizeof(uint32_t)) || nread % sizeof(uint32_t)) {
+    std::cerr << "State file " << _filename << " is truncated" << std::endl;
+    return false;
+  }
+  std::vector<uint32_t> record(buf, buf + nread / sizeof(uint32_t));
+  // the first version didn't have the current budget
+  unsigned nfields = record[1] < 2 ? 3 : 4;
+  if (record[0] != MAGIC || record[1] < 1 || record[1] > VERSION ||
+      record.size() != record[2] + nfields + 3 ||
+      record.back() != checksum(record)) {
+    std::cerr << "State file " << _filename << " is not valid" << std::endl;
+    return false;
   }
 
-  return result;
+  settings.pause = record[3];
+  settings.timeout = record[4];
+  settings.budget = nfields > 3 ? record[5] : 0;
+  for (unsigned i=0; i<record[2] && i<settings.active.size(); i++) {
+    settings.active[i] = record[nfields + 2 + i];
+  }
+  if (record[1] == VERSION && record[2] == settings.active.size()) {
+    _last = record;
+  }
+
+  return true;
 }
 
-int Control::read_value(std::string cmd, int id) const
+bool StateFile::save(const Settings& settings) const
 {
-  int result = -1;
-  
-  // read the file
-  std::ifstream file(filename(cmd, id).c_str());
-  if (file.is_open()) {
-    file >> result;
-    file.close();
+  std::vector<uint32_t> record;
+  record.push_back(MAGIC);
+  record.push_back(VERSION);
+  record.push_back(settings.active.size());
+  record.push_back(settings.pause);
+  record.push_back(settings.timeout);
+  record.push_back(settings.budget);
+  record.insert(record.end(), settings.active.begin(), settings.active.end());
+  record.push_back(0);
+  record.back() = checksum(record);
+
+  // nothing to do unless something changed
+  if (record == _last) {
+    return true;
   }
 
-  return result;
+  // write a copy and move it into place so a reboot never sees half a file
+  std::string tmpname = _filename + ".tmp";
+  int fd = ::open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Problem creating state file " << tmpname << ": "
+              << std::strerror(errno) << std::endl;
+    return false;
+  }
+  size_t nbytes = record.size() * sizeof(uint32_t);
+  if (::write(fd, &record[0], nbytes) != (ssize_t) nbytes || ::fsync(fd) < 0) {
+    std::cerr << "Problem writing state file " << tmpname << ": "
+              << std::strerror(errno) << std::endl;
+    ::close(fd);
+    std::remove(tmpname.c_str());
+    return false;
+  }
+  ::close(fd);
+  if (std::rename(tmpname.c_str(), _filename.c_str()) < 0) {
+    std::cerr << "Problem replacing state file " << _filename << ": "
+              << std::strerror(errno) << std::endl;
+    std::remove(tmpname.c_str());
+    return false;
+  }
+  _last = record;
+
+  return sync_dir();
 }
 
-bool Control::wait_value(int value, std::string cmd, unsigned long timeout, int id) const
+uint32_t StateFile::checksum(const std::vector<uint32_t>& record) const
 {
-  unsigned long long delta = 0;
-  struct timeval start, end;
-  gettimeofday(&start, NULL);
-  do {
-    if (read_value(cmd, id) == value) return true;
-    gettimeofday(&end, NULL);
-    delta = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
-  } while(delta < timeout);
-
-  return false;
+  // everything but the checksum word itself
+  uint32_t sum = 0;
+  for (unsigned i=0; i+1<record.size(); i++) {
+    sum = (sum << 1 | sum >> 31) ^ record[i];
+  }
+  return sum;
 }
 
-bool Control::write_value(unsigned value, std::string cmd, int id) const
+bool StateFile::sync_dir() const
 {
-  std::ofstream file(filename(cmd, id).c_str());
-  if (file.is_open()) {
-    file << value;
-    file.close();
-    return true;
-  } else {
+  // make the rename itself survive a power cut
+  int fd = ::open(_path.c_str(), O_RDONLY);
+  if (fd < 0) {
     return false;
   }
+  bool result = ::fsync(fd) == 0;
+  ::close(fd);
+  return result;
 }
 
-std::string Control::filename(std::string cmd, int id) const
-{
-  std::stringstream fname;
-  // construct the file name
-  fname << _path << _sep << _type << _sep << _dev;
-  // if the id is negative don't use it
-  if (id >= 0) fname << id;
-  fname << _sep << cmd;
 
-  return fname.str();
+Control::Control(Backend* backend,
+                 std::string type,
+                 std::string dev,
+                 int id,
+                 const char* const* attrs,
+                 unsigned nattrs) :
+  _backend(backend),
+  _present(true)
+{
+  const char sep = '/';
+  std::stringstream prefix;
+  // construct the keys relative to the root of the device tree
+  prefix << type << sep;
+  // if the dev is empty and the id is negative don't use them
+  if (!dev.empty() || id >= 0) {
+    prefix << dev;
+    if (id >= 0) prefix << id;
+    prefix << sep;
+  }
+  _prefix = prefix.str();
+  // build every key once rather than on each access
+  _keys.reserve(nattrs);
+  for (unsigned i=0; i<nattrs; i++) {
+    _keys.push_back(_prefix + attrs[i]);
+  }
 }
 
-PowerControl::PowerControl(std::string path, const int id) :
-  Control(path, "hwmon", "ps"),
-  _id(id)
+Control::~Control()
 {}
 
+bool Control::present() const
+{
+  return _present;
+}
+
+bool Control::probe()
+{
+  // look for the device directory once rather than failing every access
+  _present = _backend->exists(_prefix);
+  return _present;
+}
+
+std::string Control::read_raw_value(unsigned attr) const
+{
+  return _backend->read_raw_value(_keys[attr]);
+}
+
+int Control::read_value(unsigned attr) const
+{
+  return _backend->read_value(_keys[attr]);
+}
+
+bool Control::wait_value(int value, unsigned attr, unsigned long timeout) const
+{
+  // sleep between samples so the wait leaves the cpu to the network thread
+  Deadline deadline(timeout);
+  Deadline next;
+  do {
+    if (read_value(attr) == value) return true;
+    next.extend(WAIT_SAMPLE);
+    next.sleep();
+  } while(!deadline.expired());
+
+  return read_value(attr) == value;
+}
+
+bool Control::write_value(unsigned value, unsigned attr) const
+{
+  return _backend->write_value(value, _keys[attr]);
+}
+
+const char* const PowerControl::ATTRS[] = {
+  "set_power", "temp_input", "volt_input", "curr_input", "name",
+};
+
+PowerControl::PowerControl(Backend* backend, const int id) :
+  Control(backend, "hwmon", "ps", id, ATTRS, NUM_ATTRS),
+  _power(-1)
+{
+  probe();
+}
+
 PowerControl::~PowerControl()
 {}
 
 bool PowerControl::set_power(unsigned value) const
 {
-  return write_value(value, "set_power", _id);
+  bool result = write_value(value, SET_POWER);
+  _power = result ? (int) value : -1;
+  return result;
 }
 
 int PowerControl::get_power() const
 {
-  return read_value("set_power", _id);
+  _power = read_value(SET_POWER);
+  return _power;
+}
+
+int PowerControl::last_power() const
+{
+  // the value from our last read or write unless that failed
+  return _power < 0 ? get_power() : _power;
 }
 
 int PowerControl::get_temp() const
 {
-  return read_value("temp_input", _id);
+  return read_value(TEMP);
 }
 
 int PowerControl::get_voltage() const
 {
-  return read_value("volt_input", _id);
+  return read_value(VOLT);
 }
 
 int PowerControl::get_current() const
 {
-  return read_value("curr_input", _id);
+  return read_value(CURR);
 }
 
 std::string PowerControl::get_name() const
 {
-  return read_raw_value("name", _id);
+  return read_raw_value(NAME);
 }
 
-FlowMeterControl::FlowMeterControl(std::string path, const int id) :
-  Control(path, "hwmon", "gfm"),
-  _id(id)
-{}
+const char* const FlowMeterControl::ATTRS[] = {
+  "temp_input", "flow_input", "name",
+};
+
+FlowMeterControl::FlowMeterControl(Backend* backend, const int id) :
+  Control(backend, "hwmon", "gfm", id, ATTRS, NUM_ATTRS)
+{
+  probe();
+}
 
 FlowMeterControl::~FlowMeterControl()
 {}
 
 int FlowMeterControl::get_temp() const
 {
-  return read_value("temp_input", _id);
+  return read_value(TEMP);
 }
 
 int FlowMeterControl::get_flow() const
 {
-  return read_value("flow_input", _id);
+  return read_value(FLOW);
 }
 
 std::string FlowMeterControl::get_name() const
 {
-  return read_raw_value("name", _id);
+  return read_raw_value(NAME);
 }
 
-FanControl::FanControl(std::string path, const int id) :
-  Control(path, "hwmon", "fan"),
-  _id(id)
-{}
+const char* const FanControl::ATTRS[] = {
+  "fan1_input", "fan1_target", "fan1_div", "name",
+};
+
+FanControl::FanControl(Backend* backend, const int id) :
+  Control(backend, "hwmon", "fan", id, ATTRS, NUM_ATTRS)
+{
+  probe();
+}
 
 FanControl::~FanControl()
 {}
 
 int FanControl::get_input() const
 {
-  return read_value("fan1_input", _id);
+  return read_value(INPUT);
 }
 
 int FanControl::get_target() const
 {
-  return read_value("fan1_target", _id);
+  return read_value(TARGET);
 }
 
 int FanControl::get_div() const
 {
-  return read_value("fan1_div", _id);
+  return read_value(DIV);
 }
 
 std::string FanControl::get_name() const
 {
-  return read_raw_value("name", _id);
+  return read_raw_value(NAME);
 }
 
-LedControl::LedControl(std::string path) :
-  Control(path, "gpios", "")
+const char* const LedControl::ATTRS[] = {
+  "set_led_green", "set_led_red", "set_led_yellow",
+};
+
+LedControl::LedControl(Backend* backend) :
+  Control(backend, "gpios", "", -1, ATTRS, NUM_ATTRS)
 {}
 
 LedControl::~LedControl()
@@ -344,36 +511,41 @@ unsigned LedControl::get_led() const
 
 int LedControl::get_led_green() const
 {
-  return read_value("set_led_green");
+  return read_value(GREEN);
 }
 
 int LedControl::get_led_red() const
 {
-  return read_value("set_led_red");
+  return read_value(RED);
 }
 
 int LedControl::get_led_yellow() const
 {
-  return read_value("set_led_yellow");
+  return read_value(YELLOW);
 }
 
 bool LedControl::set_led_green(unsigned value) const
 {
-  return write_value(value, "set_led_green");
+  return write_value(value, GREEN);
 }
 
 bool LedControl::set_led_red(unsigned value) const
 {
-  return write_value(value, "set_led_red");
+  return write_value(value, RED);
 }
 
 bool LedControl::LedControl::set_led_yellow(unsigned value) const
 {
-  return write_value(value, "set_led_yellow");
+  return write_value(value, YELLOW);
 }
 
-MiscControl::MiscControl(std::string path) :
-  Control(path, "gpios", "")
+const char* const MiscControl::ATTRS[] = {
+  "get_autostart_enable", "get_fanctrl_enable", "get_flowmeter_enable",
+  "get_inhibit", "get_inhibit_enable", "get_powerswitch",
+};
+
+MiscControl::MiscControl(Backend* backend) :
+  Control(backend, "gpios", "", -1, ATTRS, NUM_ATTRS)
 {}
 
 MiscControl::~MiscControl()
@@ -381,81 +553,222 @@ MiscControl::~MiscControl()
 
 int MiscControl::get_autostart_enable() const
 {
-  return read_value("get_autostart_enable");
+  return read_value(AUTOSTART);
 }
 
 int MiscControl::get_fanctrl_enable() const
 {
-  return read_value("get_fanctrl_enable");
+  return read_value(FANCTRL);
 }
 
 int MiscControl::get_flowmeter_enable() const
 {
-  return read_value("get_flowmeter_enable");
+  return read_value(FLOWMETER);
 }
 
 int MiscControl::get_inhibit() const
 {
-  return read_value("get_inhibit");
+  return read_value(INHIBIT);
 }
 
 int MiscControl::get_inhibit_enable() const
 {
-  return read_value("get_inhibit_enable");
+  return read_value(INHIBIT_ENABLE);
 }
 
 int MiscControl::get_powerswitch() const
 {
-  return read_value("get_powerswitch");
+  return read_value(POWERSWITCH);
 }
 
-GpioControl::GpioControl(std::string path, const int id) :
-  Control(path, "gpios", ""),
-  _id(id),
-  _active(ALL_ON)
-{}
+const char* const BmeControl::LABELS[] = {
+  "Temperature",
+  "Humidity",
+  "Pressure",
+  "Approx. Altitude",
+};
+
+BmeControl::BmeControl(std::string device) :
+  _device(device),
+  _fd(-1),
+  _len(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  for (int i=0; i<NUM_VALUES; i++) {
+    _valid[i] = false;
+    _values[i] = 0.0;
+  }
+}
+
+BmeControl::~BmeControl()
+{
+  close();
+  pthread_mutex_destroy(&_lock);
+}
+
+bool BmeControl::open()
+{
+  close();
+
+  _fd = ::open(_device.c_str(), O_RDONLY | O_NOCTTY | O_NONBLOCK);
+  if (_fd < 0) {
+    std::cerr << "Error: failed to open BME serial port " << _device << ": "
+              << std::strerror(errno) << std::endl;
+    return false;
+  }
+
+  // raw 9600 8N1, the frames are split into lines by parse
+  struct termios t;
+  if (tcgetattr(_fd, &t) == 0) {
+    cfmakeraw(&t);
+    cfsetispeed(&t, B9600);
+    cfsetospeed(&t, B9600);
+    t.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(_fd, TCSANOW, &t);
+  }
+  _len = 0;
+
+  return true;
+}
+
+void BmeControl::close()
+{
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+int BmeControl::fd() const
+{
+  return _fd;
+}
+
+bool BmeControl::process()
+{
+  ssize_t nread;
+  while ((nread = ::read(_fd, _buf + _len, sizeof(_buf) - _len - 1)) > 0) {
+    _len += nread;
+    _buf[_len] = '\0';
+
+    // handle every complete line in the buffer
+    char* start = _buf;
+    char* end;
+    while ((end = std::strpbrk(start, "\r\n")) != NULL) {
+      *end = '\0';
+      if (end > start) parse(start);
+      start = end + 1;
+    }
+    _len -= (start - _buf);
+    if (_len == sizeof(_buf) - 1) {
+      // no line ending in sight so it must be garbage
+      _len = 0;
+    } else if (start != _buf) {
+      std::memmove(_buf, start, _len);
+    }
+  }
+
+  if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  } else {
+    std::cerr << "Error: BME serial port " << _device << " closed" << std::endl;
+    close();
+    return false;
+  }
+}
+
+bool BmeControl::has_value(Value value) const
+{
+  pthread_mutex_lock(&_lock);
+  bool valid = _valid[value];
+  pthread_mutex_unlock(&_lock);
+  return valid;
+}
+
+double BmeControl::get_value(Value value) const
+{
+  pthread_mutex_lock(&_lock);
+  double result = _values[value];
+  pthread_mutex_unlock(&_lock);
+  return result;
+}
+
+void BmeControl::parse(const char* line)
+{
+  const char* sep = std::strstr(line, " = ");
+  if (sep) {
+    size_t len = sep - line;
+    for (int i=0; i<NUM_VALUES; i++) {
+      if (std::strlen(LABELS[i]) == len && !std::strncmp(line, LABELS[i], len)) {
+        char* end = NULL;
+        double value = std::strtod(sep + 3, &end);
+        if (end != sep + 3) {
+          pthread_mutex_lock(&_lock);
+          _values[i] = value;
+          _valid[i] = true;
+          pthread_mutex_unlock(&_lock);
+        }
+        return;
+      }
+    }
+  }
+}
+
+const char* const GpioControl::ATTRS[] = {
+  "get_ac_warning", "get_dc_warning", "get_temp_warning", "set_power_supply_onoff",
+  "set_mcb1", "set_mcb2", "set_mcb3", "set_mcb4", "set_mcb5", "set_mcb6",
+  "set_mcb7", "set_mcb8", "set_mcb9", "set_mcb10", "set_mcb11", "set_mcb12",
+};
+
+GpioControl::GpioControl(Backend* backend, const int id) :
+  Control(backend, "gpios", "", id, ATTRS, NUM_ATTRS),
+  _active(ALL_ON),
+  _mask(-1)
+{
+  probe();
+}
 
 GpioControl::~GpioControl()
 {}
 
 int GpioControl::get_ac_warning() const
 {
-  return read_value("get_ac_warning", _id);
+  return read_value(AC_WARNING);
 }
 
 int GpioControl::get_dc_warning() const
 {
-  return read_value("get_dc_warning", _id);
+  return read_value(DC_WARNING);
 }
 
 int GpioControl::get_temp_warning() const
 {
-  return read_value("get_temp_warning", _id);
+  return read_value(TEMP_WARNING);
 }
 
 bool GpioControl::wait_ac_warning(int value, unsigned long timeout) const
 {
-  return wait_value(value, "get_ac_warning", timeout, _id);
+  return wait_value(value, AC_WARNING, timeout);
 }
 
 bool GpioControl::wait_dc_warning(int value, unsigned long timeout) const
 {
-  return wait_value(value, "get_dc_warning", timeout, _id);
+  return wait_value(value, DC_WARNING, timeout);
 }
 
 bool GpioControl::wait_temp_warning(int value, unsigned long timeout) const
 {
-  return wait_value(value, "get_temp_warning", timeout, _id);
+  return wait_value(value, TEMP_WARNING, timeout);
 }
 
 int GpioControl::get_power_supply_onoff() const
 {
-  return read_value("set_power_supply_onoff", _id);
+  return read_value(PS_ONOFF);
 }
 
 bool GpioControl::set_power_supply_onoff(unsigned value) const
 {
-  return write_value(value, "set_power_supply_onoff", _id);
+  return write_value(value, PS_ONOFF);
 }
 
 unsigned GpioControl::num_mcb_active() const
@@ -469,23 +782,45 @@ unsigned GpioControl::num_mcb_active() const
 
 int GpioControl::get_mcb(const int id) const
 {
-  return read_value(mcbcmd(id), _id);
+  int value = read_value(MCB1 + id - 1);
+  if (value < 0) {
+    _mask = -1;
+  } else if (_mask >= 0) {
+    _mask = (_mask & ~(1<<(id - 1))) | ((value ? 1 : 0)<<(id - 1));
+  }
+  return value;
 }
 
 bool GpioControl::set_mcb(const int id, unsigned value) const
 {
-  return write_value(value, mcbcmd(id), _id);
+  bool result = write_value(value, MCB1 + id - 1);
+  if (!result) {
+    _mask = -1;
+  } else if (_mask >= 0) {
+    _mask = (_mask & ~(1<<(id - 1))) | ((value ? 1 : 0)<<(id - 1));
+  }
+  return result;
 }
 
 int GpioControl::get_mcb_mask() const
 {
   int mask = 0;
+  bool valid = true;
   for (int i=0; i<NUM_MCB; i++) {
-    mask |= (get_mcb(i+1)<<i);
+    int value = get_mcb(i+1);
+    if (value < 0) valid = false;
+    mask |= (value<<i);
   }
+  _mask = valid ? mask : -1;
   return mask;
 }
 
+int GpioControl::last_mcb_mask() const
+{
+  // the enables from our last full read, kept up to date by our writes
+  return _mask < 0 ? get_mcb_mask() : _mask;
+}
+
 int GpioControl::get_mcb_active(const int id) const
 {
   return (_active>>(id - 1)) & 1;
@@ -498,14 +833,14 @@ int GpioControl::get_mcb_active_mask() const
 
 bool GpioControl::set_mcb_mask(unsigned mask, unsigned long pause) const
 {
-  time_t sec = pause / 1000000;
-  long nsec = (pause % 1000000) * 1000;
-  struct timespec pt = {sec, nsec};
+  // space the writes from when each one was due, not from when it finished
+  Deadline next;
   for (int i=0; i<NUM_MCB; i++) {
     if(!set_mcb(i+1, (mask>>i)&1))
       return false;
     else {
-      nanosleep(&pt, NULL);
+      next.extend(pause);
+      next.sleep();
     }
   }
   return true;
@@ -536,79 +871,115 @@ bool GpioControl::valid_mcb(const int id)
   return id > 0 && id <= NUM_MCB;
 }
 
-std::string GpioControl::mcbcmd(int id) const
-{
-  std::stringstream fname;
-  fname << "set_mcb" << id;
-
-  return fname.str();
-}
-
 const std::string CommandRunner::PSCMD = "PS";
 const std::string CommandRunner::GFMCMD = "GFM";
 const std::string CommandRunner::FANCMD = "FMON";
 const std::string CommandRunner::GPIOCMD = "GPIO";
 const std::string CommandRunner::LEDCMD = "LED";
+const std::string CommandRunner::BMECMD = "BME";
+const std::string CommandRunner::ALARMCMD = "ALARM";
 const std::string CommandRunner::WARNCMD = "WARN:";
 const std::string CommandRunner::MCBCMDS[] = {"ENABLE", "ACTIVE", ""};
 
+const char* const Runner::ERRORS[] = {
+  "NONE", "COMMAND", "INDEX", "VALUE", "MISSING", "DEVICE", "INTERLOCKED", "BUSY"
+};
+
+Runner::Runner() :
+  _stats(NULL)
+{}
+
+Runner::~Runner()
+{}
+
+std::string Runner::error(Error code)
+{
+  std::stringstream reply;
+  reply << "ERR " << code << ' ' << ERRORS[code] << '\n';
+  return reply.str();
+}
+
+bool Runner::is_error(const std::string& reply)
+{
+  return !reply.compare(0, 4, "ERR ");
+}
+
+bool Runner::expects_reply(const std::string& cmd)
+{
+  // getters and the STATE setter are the only untagged commands with a reply
+  return (!cmd.empty() && cmd[cmd.length() - 1] == '?') ||
+         !cmd.compare(0, 6, "STATE ");
+}
+
+void Runner::watch(LoopStats* stats)
+{
+  _stats = stats;
+}
+
+void Runner::progress(const std::string& what) const
+{
+  if (_stats) _stats->touch(what);
+}
+
 CommandRunner::CommandRunner(std::string name,
-                             std::string path,
+                             Backend* backend,
                              std::string logpath,
                              const unsigned num_ps,
                              const unsigned num_gpios,
                              const unsigned num_gfm,
-                             const unsigned num_fan) :
-  _num_ps(num_ps),
-  _num_gpios(num_gpios),
-  _num_gfm(num_gfm),
-  _num_fan(num_fan),
+                             const unsigned num_fan,
+                             BmeControl* bme,
+                             const bool snapshots,
+                             const bool rechecks) :
+  _num_ps(0),
+  _num_gpios(0),
+  _num_gfm(0),
+  _num_fan(0),
   _name(name),
+  _logpath(logpath),
   _pause(0),
   _timeout(0),
+  _budget(0),
   _state(new Flag(logpath, "state")),
   _block(new Lock(logpath, "block")),
+  _saved(new StateFile(logpath, "powerctrl.state")),
   _logger(new Logger(logpath, "power_control.log")),
-  _led(new LedControl(path)),
-  _misc(new MiscControl(path)),
-  _ps(num_ps > 0 ? new PowerControl*[num_ps] : NULL),
-  _ps_temp(num_ps > 0 ? new Lock*[num_ps] : NULL),
-  _gpio(num_gpios > 0 ? new GpioControl*[num_gpios] : NULL),
-  _gfm(num_gfm > 0 ? new FlowMeterControl*[num_gfm] : NULL),
-  _gfm_flow(num_gfm > 0 ? new Lock*[num_gfm] : NULL),
-  _gfm_temp(num_gfm > 0 ? new Lock*[num_gfm] : NULL),
-  _fan(num_fan > 0 ? new FanControl*[num_fan] : NULL),
-  _fan_input(num_fan > 0 ? new Lock*[num_fan] : NULL)
-{
-  for (unsigned i=0; i<num_ps; i++) {
-    std::string idx = int_to_str(i);
-    _ps[i] = new PowerControl(path, i);
-    _ps_temp[i] = new Lock(logpath, "lock_temp_ps" + idx);
-  }
-  for (unsigned j=0; j<num_gpios; j++) {
-    _gpio[j] = new GpioControl(path, j);
-  }
-  for (unsigned k=0; k<num_gfm; k++) {
-    std::string idx = int_to_str(k);
-    _gfm[k] = new FlowMeterControl(path, k);
-    _gfm_flow[k] = new Lock(logpath, "lock_wflow_gfm" + idx);
-    _gfm_temp[k] = new Lock(logpath, "lock_temp_gfm" + idx);
-  }
-  for (unsigned l=0; l<num_fan; l++) {
-    std::string idx = int_to_str(l);
-    _fan[l] = new FanControl(path, l);
-    _fan_input[l] = new Lock(logpath, "lock_fan" + idx);
-  }
+  _backend(backend),
+  _led(new LedControl(backend)),
+  _misc(new MiscControl(backend)),
+  _bme(bme),
+  _ps(num_ps),
+  _ps_temp(num_ps),
+  _gpio(num_gpios),
+  _gfm(num_gfm),
+  _gfm_flow(num_gfm),
+  _gfm_temp(num_gfm),
+  _fan(num_fan),
+  _fan_input(num_fan),
+  _alarm_action(Alarm::NONE),
+  _rechecks(rechecks),
+  _snapshots(snapshots)
+{
+  pthread_mutex_init(&_settings_lock, NULL);
+  pthread_mutex_init(&_snapshot_lock, NULL);
+  resize(num_ps, num_gpios, num_gfm, num_fan);
+  // pick up the settings from before the last restart
+  restore();
 }
 
 CommandRunner::~CommandRunner()
 {
+  pthread_mutex_destroy(&_settings_lock);
+  pthread_mutex_destroy(&_snapshot_lock);
   if (_state) {
     delete _state;
   }
   if (_block) {
     delete _block;
   }
+  if (_saved) {
+    delete _saved;
+  }
   if (_logger) {
     delete _logger;
   }
@@ -618,58 +989,133 @@ CommandRunner::~CommandRunner()
   if (_misc) {
     delete _misc;
   }
-  /* cleanup ps arrays */
-  for (unsigned i=0; i<_num_ps; i++) {
-    if (_ps && _ps[i]) delete _ps[i];
-    if (_ps_temp && _ps_temp[i]) delete _ps_temp[i];
+}
+
+void CommandRunner::resize(const unsigned num_ps,
+                           const unsigned num_gpios,
+                           const unsigned num_gfm,
+                           const unsigned num_fan)
+{
+  // devices that stay keep their state, only the ones at the end change
+  _ps.truncate(num_ps);
+  _ps_temp.truncate(num_ps);
+  _ps.reserve(num_ps);
+  _ps_temp.reserve(num_ps);
+  for (unsigned i=_ps.size(); i<num_ps; i++) {
+    std::string idx = int_to_str(i);
+    _ps.add(PowerControl(_backend, i));
+    _ps_temp.add(Lock(_logpath, "lock_temp_ps" + idx));
   }
-  if (_ps) {
-    delete[] _ps;
+  _gpio.truncate(num_gpios);
+  _gpio.reserve(num_gpios);
+  for (unsigned j=_gpio.size(); j<num_gpios; j++) {
+    _gpio.add(GpioControl(_backend, j));
   }
-  if (_ps_temp) {
-    delete[] _ps_temp;
+  _gfm.truncate(num_gfm);
+  _gfm_flow.truncate(num_gfm);
+  _gfm_temp.truncate(num_gfm);
+  _gfm.reserve(num_gfm);
+  _gfm_flow.reserve(num_gfm);
+  _gfm_temp.reserve(num_gfm);
+  for (unsigned k=_gfm.size(); k<num_gfm; k++) {
+    std::string idx = int_to_str(k);
+    _gfm.add(FlowMeterControl(_backend, k));
+    _gfm_flow.add(Lock(_logpath, "lock_wflow_gfm" + idx));
+    _gfm_temp.add(Lock(_logpath, "lock_temp_gfm" + idx));
   }
-  /* cleanup gpio arrays */
-  if (_gpio) {
-    for (unsigned j=0; j<_num_gpios; j++) {
-      if (_gpio[j]) {
-        delete _gpio[j];
-      }
-    }
-    delete[] _gpio;
+  _fan.truncate(num_fan);
+  _fan_input.truncate(num_fan);
+  _fan.reserve(num_fan);
+  _fan_input.reserve(num_fan);
+  for (unsigned l=_fan.size(); l<num_fan; l++) {
+    std::string idx = int_to_str(l);
+    _fan.add(FanControl(_backend, l));
+    _fan_input.add(Lock(_logpath, "lock_fan" + idx));
   }
-  /* cleanup the gfm arrays */
-  for (unsigned k=0; k<_num_gfm; k++) {
-    if (_gfm && _gfm[k]) delete _gfm[k];
-    if (_gfm_flow && _gfm_flow[k]) delete _gfm_flow[k];
-    if (_gfm_temp && _gfm_temp[k]) delete _gfm_temp[k];
+  _num_ps = num_ps;
+  _num_gpios = num_gpios;
+  _num_gfm = num_gfm;
+  _num_fan = num_fan;
+  _seq_on.resize(num_gpios, 0);
+  _seq_off.resize(num_gpios, 0);
+  _seq_step.resize(num_gpios, 0);
+
+  // every monitored value can have an alarm, off until thresholds are set
+  std::vector<Alarm> alarms;
+  for (unsigned i=0; i<num_ps; i++) {
+    std::string dev = PSCMD + int_to_str(i);
+    add_alarm(alarms, Alarm(dev + ":TEMP", PS_TEMP, i));
+    add_alarm(alarms, Alarm(dev + ":VOLT", PS_VOLT, i));
+    add_alarm(alarms, Alarm(dev + ":CURR", PS_CURR, i));
   }
-  if (_gfm) {
-    delete[] _gfm;
+  for (unsigned k=0; k<num_gfm; k++) {
+    std::string dev = GFMCMD + int_to_str(k);
+    add_alarm(alarms, Alarm(dev + ":FLOW", GFM_FLOW, k));
+    add_alarm(alarms, Alarm(dev + ":TEMP", GFM_TEMP, k));
   }
-  if (_gfm_flow) {
-    delete[] _gfm_flow;
+  for (unsigned l=0; l<num_fan; l++) {
+    add_alarm(alarms, Alarm(FANCMD + int_to_str(l) + ":INPUT", FAN_INPUT, l));
   }
-  if (_gfm_temp) {
-    delete[] _gfm_temp;
+  _alarms.swap(alarms);
+
+  // report what the probe of the device tree found
+  std::string found = topology();
+  _logger->info("Found devices: " + found.substr(0, found.length() - 1));
+  if (PowerControl(_backend, num_ps).present() ||
+      GpioControl(_backend, num_gpios).present() ||
+      FlowMeterControl(_backend, num_gfm).present() ||
+      FanControl(_backend, num_fan).present()) {
+    _logger->error("More devices are present than configured!");
   }
-  /* cleanup the fan arrays */
-  for (unsigned l=0; l<_num_fan; l++) {
-    if (_fan && _fan[l]) delete _fan[l];
-    if (_fan_input && _fan_input[l]) delete _fan_input[l];
+}
+
+void CommandRunner::add_alarm(std::vector<Alarm>& alarms, const Alarm& alarm) const
+{
+  // an alarm on a device that was already there keeps its thresholds
+  for (unsigned a=0; a<_alarms.size(); a++) {
+    if (!_alarms[a].name().compare(alarm.name())) {
+      alarms.push_back(_alarms[a]);
+      return;
+    }
   }
-  if (_fan) {
-    delete[] _fan;
+  alarms.push_back(alarm);
+}
+
+void CommandRunner::configure(const Config& config)
+{
+  bool changed = config.boards != _num_ps || config.boards != _num_gpios ||
+                 config.gfms != _num_gfm || config.fans != _num_fan;
+
+  // the cached getters read the devices from the network thread
+  pthread_mutex_lock(&_settings_lock);
+  _name = config.name;
+  if (changed) {
+    resize(config.boards, config.boards, config.gfms, config.fans);
+    // new boards get the active modules saved for them, if any
+    restore();
   }
-  if (_fan_input) {
-    delete[] _fan_input;
+  pthread_mutex_unlock(&_settings_lock);
+
+  if (changed) {
+    save();
+    // the metric names are built again on the next snapshot
+    pthread_mutex_lock(&_snapshot_lock);
+    _metric_names.clear();
+    _metric_values.clear();
+    pthread_mutex_unlock(&_snapshot_lock);
+    _samples.clear();
+    snapshot();
   }
+  _logger->info("Reloaded the configuration from " + config.file);
 }
 
 std::string CommandRunner::on(bool verbose) const
 {
+  bool ok = true;
+
   if (_block->is_set()) {
     _logger->error("Detector in an unsafe condition, don't start");
+    if (!verbose) return error(ERR_INTERLOCKED);
   } else {
     if (_state->is_set() && check_ps()) {
       _logger->error("Detector in inconsistent on state!");
@@ -680,8 +1126,10 @@ std::string CommandRunner::on(bool verbose) const
       if (check_enables()) {
         // update the state of the enables
         for (unsigned j=0; j<_num_gpios; j++) {
-          if (!_gpio[j]->set_mcb_on(_pause)) {
-            std::cerr << "Error: set_mcb_on(" << _pause << ") failed for GPIO " << j << std::endl;
+          if (!_gpio[j].present()) continue;
+          if (!enable_modules(j)) {
+            std::cerr << "Error: enable_modules() failed for GPIO " << j << std::endl;
+            ok = false;
           }
         }
         _logger->info("Detector enables updated");
@@ -693,18 +1141,24 @@ std::string CommandRunner::on(bool verbose) const
 
       // power on the supply
       for (unsigned i=0; i<_num_ps; i++) {
-        if (!_ps[i]->set_power(1)) {
+        if (!_ps[i].present()) continue;
+        if (!_ps[i].set_power(1)) {
           std::cerr << "Error: set_power(1) failed for power supply " << i << std::endl;
+          ok = false;
         }
       }
 
       // turn on the enables
       for (unsigned j=0; j<_num_gpios; j++) {
-        if (!_gpio[j]->set_mcb_on(_pause)) {
-          std::cerr << "Error: set_mcb_on(" << _pause << ") failed for GPIO " << j << std::endl;
+        if (!_gpio[j].present()) continue;
+        if (!enable_modules(j)) {
+          std::cerr << "Error: enable_modules() failed for GPIO " << j << std::endl;
+          ok = false;
         }
-        if (!_gpio[j]->wait_dc_warning(0, _timeout)) {
+        progress("ON " + GPIOCMD + int_to_str(j) + " DC");
+        if (!_gpio[j].wait_dc_warning(0, _timeout)) {
           std::cerr << "Error: wait_dc_warning(0, " << _timeout << ") failed for GPIO " << j << std::endl;
+          ok = false;
         }
       }
 
@@ -717,6 +1171,8 @@ std::string CommandRunner::on(bool verbose) const
 
   if (verbose) {
     return state();
+  } else if (!ok) {
+    return error(ERR_DEVICE);
   } else {
     return std::string("");
   }
@@ -724,6 +1180,8 @@ std::string CommandRunner::on(bool verbose) const
 
 std::string CommandRunner::off(bool verbose) const
 {
+  bool ok = true;
+
   if (is_off()) {
     _logger->error("Detector already off!");
   } else {
@@ -731,22 +1189,29 @@ std::string CommandRunner::off(bool verbose) const
 
     // turn off the enables
     for (unsigned j=0; j<_num_gpios; j++) {
-      if (!_gpio[j]->set_mcb_off(_pause)) {
+      if (!_gpio[j].present()) continue;
+      if (!set_modules(j, 0, "OFF")) {
         std::cerr << "Error: set_mcb_off(" << _pause << ") failed for GPIO " << j << std::endl;
+        ok = false;
       }
     }
 
     // power off the supply
     for (unsigned i=0; i<_num_ps; i++) {
-      if (!_ps[i]->set_power(0)) {
+      if (!_ps[i].present()) continue;
+      if (!_ps[i].set_power(0)) {
         std::cerr << "Error: set_power(0) failed for power supply " << i << std::endl;
+        ok = false;
       }
     }
 
     // wait for the power supply to ramp down
     for (unsigned j=0; j<_num_gpios; j++) {
-      if (!_gpio[j]->wait_dc_warning(1, _timeout)) {
+      if (!_gpio[j].present()) continue;
+      progress("OFF " + GPIOCMD + int_to_str(j) + " DC");
+      if (!_gpio[j].wait_dc_warning(1, _timeout)) {
         std::cerr << "Error: wait_dc_warning(1, " << _timeout << ") failed for GPIO " << j << std::endl;
+        ok = false;
       }
     }
 
@@ -758,6 +1223,8 @@ std::string CommandRunner::off(bool verbose) const
 
   if (verbose) {
     return state();
+  } else if (!ok) {
+    return error(ERR_DEVICE);
   } else {
     return std::string("");
   }
@@ -781,7 +1248,15 @@ std::string CommandRunner::run(const std::string& cmd)
   std::string value = cmd.substr(vpos == std::string::npos ? 0 : vpos+1,
                                  vpos == std::string::npos ? 0 : std::string::npos);
 
-  if (is_ps_cmd(cmd)) {
+  if (is_ps_cmd(cmd) && is_range_cmd(PSCMD, prefix)) {
+    return run_range(PSCMD, prefix, suffix, value);
+  } else if (is_gfm_cmd(cmd) && is_range_cmd(GFMCMD, prefix)) {
+    return run_range(GFMCMD, prefix, suffix, value);
+  } else if (is_fan_cmd(cmd) && is_range_cmd(FANCMD, prefix)) {
+    return run_range(FANCMD, prefix, suffix, value);
+  } else if (is_gpio_cmd(cmd) && is_range_cmd(GPIOCMD, prefix)) {
+    return run_range(GPIOCMD, prefix, suffix, value);
+  } else if (is_ps_cmd(cmd)) {
     return run_ps(prefix, suffix, value);
   } else if (is_gfm_cmd(cmd)) {
     return run_gfm(prefix, suffix, value);
@@ -791,11 +1266,143 @@ std::string CommandRunner::run(const std::string& cmd)
     return run_gpios(prefix, suffix, value);
   } else if (is_led_cmd(cmd)) {
     return run_led(suffix, value);
+  } else if (is_bme_cmd(cmd)) {
+    return run_bme(suffix, value);
+  } else if (is_alarm_cmd(cmd)) {
+    return run_alarm(suffix, value);
   } else {
     return run_base(suffix, value);
   }
 }
 
+void CommandRunner::verify()
+{
+  bool state = _state->is_set();
+  bool changed = false;
+
+  // catch anything changed behind our back since the last pass
+  _state->invalidate();
+  if (_state->is_set() != state) changed = true;
+  for (unsigned i=0; i<_num_ps; i++) {
+    if (!_ps[i].present()) continue;
+    int power = _ps[i].last_power();
+    if (_ps[i].get_power() != power) changed = true;
+  }
+  for (unsigned j=0; j<_num_gpios; j++) {
+    if (!_gpio[j].present()) continue;
+    int mask = _gpio[j].last_mcb_mask();
+    if (_gpio[j].get_mcb_mask() != mask) changed = true;
+  }
+
+  if (changed) {
+    _logger->info("Detector power state changed outside of powerctrl");
+  }
+
+  check_alarms();
+  // only sweep the sensors again if there is a metrics page to show them
+  if (_snapshots) snapshot();
+}
+
+void CommandRunner::metrics(std::string& page) const
+{
+  char buf[32];
+  pthread_mutex_lock(&_snapshot_lock);
+  for (unsigned i=0; i<_metric_values.size(); i++) {
+    // skip anything that couldn't be read on the last pass
+    if (_metric_values[i] != _metric_values[i]) continue;
+    std::snprintf(buf, sizeof(buf), " %.10g\n", _metric_values[i]);
+    page += _metric_names[i];
+    page += buf;
+  }
+  pthread_mutex_unlock(&_snapshot_lock);
+}
+
+void CommandRunner::snapshot()
+{
+  static const char* const BME_METRICS[] = { "bme_temp", "bme_humid", "bme_press", "bme_alt" };
+  unsigned n = 0;
+
+  record(n, "state", NULL, "", _state->is_set());
+  record(n, "blocked", NULL, "", _block->is_set());
+  record(n, "modules", NULL, "", num_active_modules());
+  for (unsigned i=0; i<_num_ps; i++) {
+    std::string id = int_to_str(i);
+    bool present = _ps[i].present();
+    record(n, "ps_power", "ps", id, present ? _ps[i].last_power() : 0, present);
+    record(n, "ps_temp", "ps", id, present ? _ps[i].get_temp() : 0, present);
+    record(n, "ps_voltage", "ps", id, present ? _ps[i].get_voltage() : 0, present);
+    record(n, "ps_current", "ps", id, present ? _ps[i].get_current() : 0, present);
+    record(n, "ps_lock_temp", "ps", id, _ps_temp[i].is_set());
+  }
+  for (unsigned j=0; j<_num_gpios; j++) {
+    std::string id = int_to_str(j);
+    bool present = _gpio[j].present();
+    record(n, "gpio_enable_mask", "gpio", id, present ? _gpio[j].last_mcb_mask() : 0, present);
+    record(n, "gpio_active_mask", "gpio", id, _gpio[j].get_mcb_active_mask(), present);
+    record(n, "gpio_warning_ac", "gpio", id, present ? _gpio[j].get_ac_warning() : 0, present);
+    record(n, "gpio_warning_dc", "gpio", id, present ? _gpio[j].get_dc_warning() : 0, present);
+    record(n, "gpio_warning_temp", "gpio", id, present ? _gpio[j].get_temp_warning() : 0, present);
+  }
+  for (unsigned k=0; k<_num_gfm; k++) {
+    std::string id = int_to_str(k);
+    bool present = _gfm[k].present();
+    record(n, "gfm_flow", "gfm", id, present ? _gfm[k].get_flow() : 0, present);
+    record(n, "gfm_temp", "gfm", id, present ? _gfm[k].get_temp() : 0, present);
+    record(n, "gfm_lock_flow", "gfm", id, _gfm_flow[k].is_set());
+    record(n, "gfm_lock_temp", "gfm", id, _gfm_temp[k].is_set());
+  }
+  for (unsigned l=0; l<_num_fan; l++) {
+    std::string id = int_to_str(l);
+    bool present = _fan[l].present();
+    record(n, "fan_input", "fan", id, present ? _fan[l].get_input() : 0, present);
+    record(n, "fan_target", "fan", id, present ? _fan[l].get_target() : 0, present);
+    record(n, "fan_lock_input", "fan", id, _fan_input[l].is_set());
+  }
+  for (int v=0; v<BmeControl::NUM_VALUES; v++) {
+    BmeControl::Value bval = (BmeControl::Value) v;
+    bool valid = _bme && _bme->has_value(bval);
+    record(n, BME_METRICS[v], NULL, "", valid ? _bme->get_value(bval) : 0.0, valid);
+  }
+  for (unsigned a=0; a<_alarms.size(); a++) {
+    record(n, "alarm", "channel", _alarms[a].name(), _alarms[a].level(), _alarms[a].enabled());
+  }
+
+  // only the copy has to wait for the metrics page
+  pthread_mutex_lock(&_snapshot_lock);
+  _metric_values = _samples;
+  pthread_mutex_unlock(&_snapshot_lock);
+}
+
+void CommandRunner::record(unsigned& index, const char* metric, const char* label,
+                           const std::string& id, double value, bool valid)
+{
+  // the names only have to be built on the first pass
+  if (index >= _metric_names.size()) {
+    std::string name = std::string("powerctrl_") + metric;
+    if (label) {
+      name += std::string("{") + label + "=\"" + id + "\"}";
+    }
+    pthread_mutex_lock(&_snapshot_lock);
+    _metric_names.push_back(name);
+    pthread_mutex_unlock(&_snapshot_lock);
+    _samples.push_back(0.0);
+  }
+  _samples[index++] = valid ? value : std::numeric_limits<double>::quiet_NaN();
+}
+
+bool CommandRunner::cached(const std::string& cmd, std::string& reply)
+{
+  if (is_cached_cmd(cmd)) {
+    // safe to call from another thread while the hardware is busy
+    pthread_mutex_lock(&_settings_lock);
+    reply = run(cmd);
+    pthread_mutex_unlock(&_settings_lock);
+    return true;
+  } else {
+    return false;
+  }
+}
+
 std::string CommandRunner::run_led(const std::string& cmd,
                                    const std::string& value) const
 {
@@ -811,36 +1418,89 @@ std::string CommandRunner::run_led(const std::string& cmd,
     } else if (cmd.empty() || cmd[cmd.length() - 1] == '?') {
       std::cerr << "Error: invalid led get command received: "
                 << cmd << std::endl;
+      return error(ERR_COMMAND);
     } else {
       std::cerr << "Error: received an led set command without a value" << std::endl;
+      return error(ERR_COMMAND);
     }
   } else {
     char* end = NULL;
     unsigned ivalue = std::strtoul(value.c_str(), &end, 0);
     if (*end != '\0') {
       std::cerr << "Error: invalid led set command value: " << value << std::endl;
+      return error(ERR_VALUE);
     } else if (!cmd.compare("MASK")) {
       if (!_led->set_led(ivalue)) {
         std::cerr << "Error: set_led(" << value << ") failed" << std::endl;
+        return error(ERR_DEVICE);
       }
     } else if (!cmd.compare("GREEN")) {
       if (!_led->set_led_green(ivalue)) {
         std::cerr << "Error: set_green_led(" << value << ") failed" << std::endl;
+        return error(ERR_DEVICE);
       }
     } else if (!cmd.compare("YELLOW")) {
       if (!_led->set_led_yellow(ivalue)) {
         std::cerr << "Error: set_yellow_led(" << value << ") failed" << std::endl;
+        return error(ERR_DEVICE);
       }
     } else if (!cmd.compare("RED")) {
       if (!_led->set_led_red(ivalue)) {
         std::cerr << "Error: set_red_led(" << value << ") failed" << std::endl;
+        return error(ERR_DEVICE);
       }
     } else if (cmd.empty() || cmd[cmd.length() - 1] != '?') {
       std::cerr << "Error: invalid led set command received: "
                 << cmd  << std::endl;
+      return error(ERR_COMMAND);
     } else {
       std::cerr << "Error: received an led get command with a value" << std::endl;
+      return error(ERR_COMMAND);
+    }
+  }
+
+  return std::string("");
+}
+
+std::string CommandRunner::run_bme(const std::string& cmd,
+                                   const std::string& value) const
+{
+  if (!_bme) {
+    std::cerr << "Error: received a BME command but there is no BME sensor" << std::endl;
+    return error(ERR_MISSING);
+  } else if (value.empty()) {
+    int idx = -1;
+    if (!cmd.compare("TEMP?")) {
+      idx = BmeControl::TEMP;
+    } else if (!cmd.compare("HUMID?")) {
+      idx = BmeControl::HUMID;
+    } else if (!cmd.compare("PRESS?")) {
+      idx = BmeControl::PRESS;
+    } else if (!cmd.compare("ALT?")) {
+      idx = BmeControl::ALT;
+    } else if (cmd.empty() || cmd[cmd.length() - 1] == '?') {
+      std::cerr << "Error: invalid BME get command received: "
+                << cmd << std::endl;
+      return error(ERR_COMMAND);
+    } else {
+      std::cerr << "Error: received a BME set command without a value" << std::endl;
+      return error(ERR_COMMAND);
     }
+
+    if (idx >= 0) {
+      BmeControl::Value bval = (BmeControl::Value) idx;
+      if (_bme->has_value(bval)) {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), "%.3f\n", _bme->get_value(bval));
+        return std::string(buf);
+      } else {
+        std::cerr << "Error: no BME reading received yet for " << cmd << std::endl;
+        return error(ERR_MISSING);
+      }
+    }
+  } else {
+    std::cerr << "Error: received a BME command with a value" << std::endl;
+    return error(ERR_COMMAND);
   }
 
   return std::string("");
@@ -854,47 +1514,58 @@ std::string CommandRunner::run_ps(const std::string& prefix,
   unsigned index = std::strtoul(prefix.substr(PSCMD.length()).c_str(), &end, 0);
   if (*end != '\0') {
     std::cerr << "Error: invalid power supply prefix: " << prefix << std::endl;
+    return error(ERR_INDEX);
+  } else if (index < _num_ps && !_ps[index].present()) {
+    std::cerr << "Error: power supply " << index << " is not present" << std::endl;
+    return error(ERR_MISSING);
   } else if (index < _num_ps) {
     if (value.empty()) {
       if (!cmd.compare("NAME?")) {
-        return _ps[index]->get_name() + '\n';
+        return _ps[index].get_name() + '\n';
       } else if (!cmd.compare("TEMP?")) {
-        return int_to_reply(_ps[index]->get_temp());
+        return int_to_reply(_ps[index].get_temp());
       } else if (!cmd.compare("VOLT?")) {
-        if(_ps[index]->get_power())
-            return int_to_reply(_ps[index]->get_voltage());
+        if(_ps[index].get_power())
+            return int_to_reply(_ps[index].get_voltage());
         else
             return int_to_reply(0);
       } else if (!cmd.compare("CURR?")) {
-        return int_to_reply(_ps[index]->get_current());
+        return int_to_reply(_ps[index].get_current());
       } else if (!cmd.compare("POWER?")) {
-        return int_to_reply(_ps[index]->get_power());
+        return int_to_reply(_ps[index].get_power());
       } else if (!cmd.compare("LOCKTEMP?")) {
-        return lock_to_reply(_ps_temp[index]);
+        return lock_to_reply(&_ps_temp[index]);
       } else if (cmd.empty() || cmd[cmd.length() - 1] == '?') {
           std::cerr << "Error: invalid power supply get command received: "
                     << cmd << std::endl;
+          return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received a power supply set command without a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     } else {
       unsigned ivalue = std::strtoul(value.c_str(), &end, 0);
       if (*end != '\0') {
         std::cerr << "Error: invalid power supply set command value: " << value << std::endl;
+        return error(ERR_VALUE);
       } else if (!cmd.compare("POWER")) {
-        if (!_ps[index]->set_power(ivalue)) {
+        if (!_ps[index].set_power(ivalue)) {
           std::cerr << "Error: set_power(" << value << ") failed for power supply "
                     << index << std::endl;
+          return error(ERR_DEVICE);
         }
       } else if (cmd.empty() || cmd[cmd.length() - 1] != '?') {
         std::cerr << "Error: invalid power supply set command received: "
                   << cmd  << std::endl;
+        return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received a power supply get command with a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     }
   } else {
     std::cerr << "Power supply index out-of-range: " << index << std::endl;
+    return error(ERR_INDEX);
   }
 
   return std::string("");
@@ -908,37 +1579,47 @@ std::string CommandRunner::run_gfm(const std::string& prefix,
   unsigned index = std::strtoul(prefix.substr(GFMCMD.length()).c_str(), &end, 0);
   if (*end != '\0') {
     std::cerr << "Error: invalid flow meter prefix: " << prefix << std::endl;
+    return error(ERR_INDEX);
+  } else if (index < _num_gfm && !_gfm[index].present()) {
+    std::cerr << "Error: flow meter " << index << " is not present" << std::endl;
+    return error(ERR_MISSING);
   } else if (index < _num_gfm) {
     if (value.empty()) {
       if (!cmd.compare("NAME?")) {
-        return _gfm[index]->get_name() + '\n';
+        return _gfm[index].get_name() + '\n';
       } else if (!cmd.compare("TEMP?")) {
-        return int_to_reply(_gfm[index]->get_temp());
+        return int_to_reply(_gfm[index].get_temp());
       } else if (!cmd.compare("FLOW?")) {
-        return int_to_reply(_gfm[index]->get_flow());
+        return int_to_reply(_gfm[index].get_flow());
       } else if (!cmd.compare("LOCKTEMP?")) {
-        return lock_to_reply(_gfm_temp[index]);
+        return lock_to_reply(&_gfm_temp[index]);
       } else if (!cmd.compare("LOCKFLOW?")) {
-        return lock_to_reply(_gfm_flow[index]);
+        return lock_to_reply(&_gfm_flow[index]);
       } else if (cmd.empty() || cmd[cmd.length() - 1] == '?') {
         std::cerr << "Error: invalid flow meter get command received: "
                   << cmd << std::endl;
+        return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received a flow meter set command without a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     } else {
       //unsigned ivalue = std::strtoul(value.c_str(), &end, 0);
       if (*end != '\0') {
         std::cerr << "Error: invalid flow meter set command value: " << value << std::endl;
+        return error(ERR_VALUE);
       } else if (cmd.empty() || cmd[cmd.length() - 1] != '?') {
         std::cerr << "Error: invalid flow meter set command received: "
                   << cmd  << std::endl;
+        return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received a flow meter get command with a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     }
   } else {
     std::cerr << "Flow meter index out-of-range: " << index << std::endl;
+    return error(ERR_INDEX);
   }
   return std::string("");
 }
@@ -951,37 +1632,47 @@ std::string CommandRunner::run_fan(const std::string& prefix,
   unsigned index = std::strtoul(prefix.substr(FANCMD.length()).c_str(), &end, 0);
   if (*end != '\0') {
     std::cerr << "Error: invalid fan prefix: " << prefix << std::endl;
+    return error(ERR_INDEX);
+  } else if (index < _num_fan && !_fan[index].present()) {
+    std::cerr << "Error: fan " << index << " is not present" << std::endl;
+    return error(ERR_MISSING);
   } else if (index < _num_fan) {
     if (value.empty()) {
       if (!cmd.compare("NAME?")) {
-        return _fan[index]->get_name() + '\n';
+        return _fan[index].get_name() + '\n';
       } else if (!cmd.compare("INPUT?")) {
-        return int_to_reply(_fan[index]->get_input());
+        return int_to_reply(_fan[index].get_input());
       } else if (!cmd.compare("TARGET?")) {
-        return int_to_reply(_fan[index]->get_target());
+        return int_to_reply(_fan[index].get_target());
       } else if (!cmd.compare("DIV?")) {
-        return int_to_reply(_fan[index]->get_div());
+        return int_to_reply(_fan[index].get_div());
       } else if (!cmd.compare("LOCKINPUT?")) {
-        return lock_to_reply(_fan_input[index]);
+        return lock_to_reply(&_fan_input[index]);
       } else if (cmd.empty() || cmd[cmd.length() - 1] == '?') {
         std::cerr << "Error: invalid fan get command received: "
                   << cmd << std::endl;
+        return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received a fan set command without a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     } else {
       //unsigned ivalue = std::strtoul(value.c_str(), &end, 0);
       if (*end != '\0') {
         std::cerr << "Error: invalid fan set command value: " << value << std::endl;
+        return error(ERR_VALUE);
       } else if (cmd.empty() || cmd[cmd.length() - 1] != '?') {
         std::cerr << "Error: invalid fan set command received: "
                   << cmd  << std::endl;
+        return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received a fan get command with a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     }
   } else {
     std::cerr << "Fan index out-of-range: " << index << std::endl;
+    return error(ERR_INDEX);
   }
   return std::string("");
 }
@@ -989,33 +1680,39 @@ std::string CommandRunner::run_fan(const std::string& prefix,
 
 std::string CommandRunner::run_gpios(const std::string& prefix,
                                      const std::string& cmd,
-                                     const std::string& value) const
+                                     const std::string& value)
 {
   char* end = NULL;
   unsigned index = std::strtoul(prefix.substr(GPIOCMD.length()).c_str(), &end, 0);
   if (*end != '\0') {
     std::cerr << "Error: invalid GPIO prefix: " << prefix << std::endl;
+    return error(ERR_INDEX);
+  } else if (index < _num_gpios && !_gpio[index].present()) {
+    std::cerr << "Error: GPIO " << index << " is not present" << std::endl;
+    return error(ERR_MISSING);
   } else if (index < _num_gpios) {
     if (value.empty()) {
       if (!cmd.compare("POWER?")) {
-        return int_to_reply(_gpio[index]->get_power_supply_onoff());
+        return int_to_reply(_gpio[index].get_power_supply_onoff());
       } else if (!cmd.compare("ENABLE?")) {
-        return int_to_reply(_gpio[index]->get_mcb_mask());
+        return int_to_reply(_gpio[index].get_mcb_mask());
       } else if (!cmd.compare("ACTIVE?")) {
-        return int_to_reply(_gpio[index]->get_mcb_active_mask());
+        return int_to_reply(_gpio[index].get_mcb_active_mask());
       } else if (is_warn_cmd(cmd)) {
         std::string warncmd = cmd.substr(WARNCMD.length());
         if (!warncmd.compare("AC?")) {
-          return int_to_reply(_gpio[index]->get_ac_warning());
+          return int_to_reply(_gpio[index].get_ac_warning());
         } else if (!warncmd.compare("DC?")) {
-          return int_to_reply(_gpio[index]->get_dc_warning());
+          return int_to_reply(_gpio[index].get_dc_warning());
         } else if (!warncmd.compare("TEMP?")) {
-          return int_to_reply(_gpio[index]->get_temp_warning());
+          return int_to_reply(_gpio[index].get_temp_warning());
         } else if (warncmd.empty() || warncmd[warncmd.length() - 1] == '?') {
           std::cerr << "Error: invalid gpio get command received: "
                     << warncmd  << std::endl;
+          return error(ERR_COMMAND);
         } else {
           std::cerr << "Error: received an GPIO set command without a value" << std::endl;
+          return error(ERR_COMMAND);
         }
       } else if (is_mcb_cmd(cmd)) {
         std::string prefix = get_mcb_prefix(cmd);
@@ -1023,69 +1720,414 @@ std::string CommandRunner::run_gpios(const std::string& prefix,
         if (mcbidx < 0) {
           if (cmd.empty() || cmd[cmd.length() - 1] == '?'){
             std::cerr << "Error: invalid mcb get prefix: " << cmd << std::endl;
+            return error(ERR_INDEX);
           } else {
             std::cerr << "Error: received an GPIO set command without a value" << std::endl;
+            return error(ERR_COMMAND);
           }
         } else if (!prefix.compare("ENABLE")) {
-          return int_to_reply(_gpio[index]->get_mcb(mcbidx));
+          return int_to_reply(_gpio[index].get_mcb(mcbidx));
         } else if (!prefix.compare("ACTIVE")) {
-          return int_to_reply(_gpio[index]->get_mcb_active(mcbidx));
+          return int_to_reply(_gpio[index].get_mcb_active(mcbidx));
         } else {
           std::cerr << "Error: get command is not implement for mcb prefix: " << prefix << std::endl;
+          return error(ERR_COMMAND);
         }
       } else if (cmd.empty() || cmd[cmd.length() - 1] == '?'){
         std::cerr << "Error: invalid gpio get command received: "
                   << cmd  << std::endl;
+        return error(ERR_COMMAND);
       } else {
         std::cerr << "Error: received an GPIO set command without a value" << std::endl;
+        return error(ERR_COMMAND);
       }
     } else {
       unsigned ivalue = std::strtoul(value.c_str(), &end, 0);
       if (*end != '\0') {
         std::cerr << "Error: invalid GPIO set command value: " << value << std::endl;
+        return error(ERR_VALUE);
       } else if (!cmd.compare("POWER")) {
-        if (!_gpio[index]->set_power_supply_onoff(ivalue)) {
+        if (!_gpio[index].set_power_supply_onoff(ivalue)) {
           std::cerr << "Error: set_power_supply_onoff(" << value << ") failed for GPIO "
                     << index << std::endl;
+          return error(ERR_DEVICE);
         }
       } else if (!cmd.compare("ENABLE")) {
-        if (!_gpio[index]->set_mcb_mask(ivalue)) {
+        if (!_gpio[index].set_mcb_mask(ivalue)) {
           std::cerr << "Error: set_mcb_mask(" << value << ") failed for GPIO "
                     << index << std::endl;
+          return error(ERR_DEVICE);
         }
       } else if (!cmd.compare("ACTIVE")) {
-        _gpio[index]->set_mcb_active_mask(ivalue);
+        pthread_mutex_lock(&_settings_lock);
+        _gpio[index].set_mcb_active_mask(ivalue);
+        pthread_mutex_unlock(&_settings_lock);
+        save();
       } else if (is_mcb_cmd(cmd)) {
         std::string prefix = get_mcb_prefix(cmd);
         int mcbidx = get_mcb_index(cmd, prefix, '\0');
         if (mcbidx < 0) {
           if (cmd.empty() || cmd[cmd.length() - 1] != '?') {
             std::cerr << "Error: invalid mcb set prefix: " << cmd << std::endl;
+            return error(ERR_INDEX);
           } else {
             std::cerr << "Error: received an GPIO get command with a value" << std::endl;
+            return error(ERR_COMMAND);
           }
         } else if (!prefix.compare("ENABLE")) {
-          if (!_gpio[index]->set_mcb(mcbidx, ivalue)) {
+          if (!_gpio[index].set_mcb(mcbidx, ivalue)) {
             std::cerr << "Error: set_mcb(" << mcbidx << ", " << value << ") failed for GPIO "
                       << index << std::endl;
+            return error(ERR_DEVICE);
           }
         } else if (!prefix.compare("ACTIVE")) {
-          _gpio[index]->set_mcb_active(mcbidx, ivalue);
+          pthread_mutex_lock(&_settings_lock);
+          _gpio[index].set_mcb_active(mcbidx, ivalue);
+          pthread_mutex_unlock(&_settings_lock);
+          save();
         } else {
           std::cerr << "Error: set command is not implement for mcb prefix: " << prefix << std::endl;
+          return error(ERR_COMMAND);
         }
       } else {
         std::cerr << "Error: invalid GPIO set command received: "
                   << cmd  << std::endl;
+        return error(ERR_COMMAND);
       }
     }
   } else {
     std::cerr << "GPIO index out-of-range: " << index << std::endl;
+    return error(ERR_INDEX);
   }
 
   return std::string("");
 }
 
+std::string CommandRunner::run_alarm(const std::string& cmd,
+                                     const std::string& value)
+{
+  std::string setting;
+  Alarm* alarm = NULL;
+
+  if (value.empty()) {
+    if (!cmd.compare("ALARM?")) {
+      std::string reply;
+      for (unsigned i=0; i<_alarms.size(); i++) {
+        if (_alarms[i].level() != Alarm::OK) {
+          reply += _alarms[i].name() + "=" + Alarm::LEVELS[_alarms[i].level()] + " ";
+        }
+      }
+      if (reply.empty()) {
+        return std::string("NONE\n");
+      } else {
+        reply[reply.length() - 1] = '\n';
+        return reply;
+      }
+    } else if (!cmd.compare("ACTION?")) {
+      return std::string(Alarm::ACTIONS[_alarm_action]) + '\n';
+    } else if ((alarm = find_alarm(cmd, setting)) == NULL) {
+      std::cerr << "Error: invalid alarm get command received: "
+                << cmd << std::endl;
+      return error(ERR_COMMAND);
+    } else if (!setting.compare("?")) {
+      return std::string(Alarm::LEVELS[alarm->level()]) + '\n';
+    } else if (!setting.compare(":HIGH?") || !setting.compare(":LOW?")) {
+      Alarm::Level level = setting[1] == 'H' ? Alarm::HIGH : Alarm::LOW;
+      if (alarm->has_limit(level)) {
+        return int_to_reply(alarm->limit(level));
+      } else {
+        return std::string("NONE\n");
+      }
+    } else if (!setting.compare(":HYST?")) {
+      return int_to_reply(alarm->hysteresis());
+    } else if (!setting.compare(":DEBOUNCE?")) {
+      return int_to_reply(alarm->debounce());
+    } else if (setting.empty() || setting[setting.length() - 1] == '?') {
+      std::cerr << "Error: invalid alarm get command received: "
+                << cmd << std::endl;
+      return error(ERR_COMMAND);
+    } else {
+      std::cerr << "Error: received an alarm set command without a value" << std::endl;
+      return error(ERR_COMMAND);
+    }
+  } else if (!_rechecks && (!cmd.compare("ACTION") || find_alarm(cmd, setting))) {
+    // the setting would take but the alarm would never be checked
+    std::cerr << "Error: alarms can't be set with the -V recheck disabled" << std::endl;
+    return error(ERR_DEVICE);
+  } else if (!cmd.compare("ACTION")) {
+    int action = -1;
+    for (int i=0; i<Alarm::NUM_ACTIONS; i++) {
+      if (!value.compare(Alarm::ACTIONS[i])) action = i;
+    }
+    if (action < 0) {
+      std::cerr << "Error: invalid alarm action: " << value << std::endl;
+      return error(ERR_VALUE);
+    } else {
+      _alarm_action = (Alarm::Action) action;
+    }
+  } else if ((alarm = find_alarm(cmd, setting)) == NULL) {
+    std::cerr << "Error: invalid alarm set command received: "
+              << cmd << std::endl;
+    return error(ERR_COMMAND);
+  } else {
+    char* end = NULL;
+    long ivalue = std::strtol(value.c_str(), &end, 0);
+    bool none = !value.compare("NONE");
+    if (!none && *end != '\0') {
+      std::cerr << "Error: invalid alarm set command value: " << value << std::endl;
+      return error(ERR_VALUE);
+    } else if (!setting.compare(":HIGH") || !setting.compare(":LOW")) {
+      Alarm::Level level = setting[1] == 'H' ? Alarm::HIGH : Alarm::LOW;
+      if (none) {
+        alarm->clear_limit(level);
+      } else {
+        alarm->set_limit(level, ivalue);
+      }
+    } else if (none) {
+      std::cerr << "Error: invalid alarm set command value: " << value << std::endl;
+      return error(ERR_VALUE);
+    } else if (!setting.compare(":HYST")) {
+      alarm->set_hysteresis(ivalue);
+    } else if (!setting.compare(":DEBOUNCE")) {
+      alarm->set_debounce(ivalue);
+    } else if (setting.empty() || setting[setting.length() - 1] != '?') {
+      std::cerr << "Error: invalid alarm set command received: "
+                << cmd  << std::endl;
+      return error(ERR_COMMAND);
+    } else {
+      std::cerr << "Error: received an alarm get command with a value" << std::endl;
+      return error(ERR_COMMAND);
+    }
+  }
+
+  return std::string("");
+}
+
+std::string CommandRunner::run_modules(const std::string& value)
+{
+  size_t spos = value.find(' ');
+  std::string action = value.substr(0, spos);
+  bool on = !action.compare("ON");
+  if ((!on && action.compare("OFF")) || spos == std::string::npos) {
+    std::cerr << "Error: invalid value for MODULES command: " << value << std::endl;
+    return error(ERR_VALUE);
+  } else if (on && _block->is_set()) {
+    _logger->error("Detector in an unsafe condition, don't enable modules");
+    return error(ERR_INTERLOCKED);
+  }
+
+  // modules are numbered across the boards, e.g. 12 is the first of GPIO1
+  std::vector<unsigned> mask(_num_gpios, 0);
+  const char* pos = value.c_str() + spos + 1;
+  while (true) {
+    char* end = NULL;
+    unsigned first = std::strtoul(pos, &end, 10);
+    unsigned last = first;
+    if (end != pos && *end == '-') {
+      pos = end + 1;
+      last = std::strtoul(pos, &end, 10);
+    }
+    if (end == pos || (*end != ',' && *end != '\0')) {
+      std::cerr << "Error: invalid module list for MODULES command: " << value << std::endl;
+      return error(ERR_VALUE);
+    } else if (first > last || last >= _num_gpios * GpioControl::NUM_MCB) {
+      std::cerr << "Error: module out-of-range for MODULES command: " << value << std::endl;
+      return error(ERR_INDEX);
+    }
+    for (unsigned m=first; m<=last; m++) {
+      mask[m / GpioControl::NUM_MCB] |= 1 << (m % GpioControl::NUM_MCB);
+    }
+    if (*end == '\0') break;
+    pos = end + 1;
+  }
+
+  // check the whole list before queueing any of it
+  for (unsigned j=0; j<_num_gpios; j++) {
+    if (!mask[j]) continue;
+    if (!_gpio[j].present()) {
+      std::cerr << "Error: GPIO " << j << " is not present" << std::endl;
+      return error(ERR_MISSING);
+    } else if (on && (mask[j] & ~_gpio[j].get_mcb_active_mask())) {
+      // ON would never enable these, and STATE? would read ERROR after
+      std::cerr << "Error: modules outside the ACTIVE mask of GPIO " << j
+                << " for MODULES command: " << value << std::endl;
+      return error(ERR_VALUE);
+    } else if (on && j < _num_ps && _ps[j].present() && !_ps[j].last_power()) {
+      std::cerr << "Error: power supply " << j << " is off, can't enable its modules" << std::endl;
+      return error(ERR_INTERLOCKED);
+    }
+  }
+
+  // a later request for the same module wins over an earlier one
+  for (unsigned j=0; j<_num_gpios; j++) {
+    if (on) {
+      _seq_on[j] |= mask[j];
+      _seq_off[j] &= ~mask[j];
+    } else {
+      _seq_off[j] |= mask[j];
+      _seq_on[j] &= ~mask[j];
+    }
+  }
+  _seq_limit = Deadline(_timeout);
+
+  return std::string("");
+}
+
+void CommandRunner::cancel_modules()
+{
+  if (num_pending_modules()) {
+    _logger->info("Dropping the modules still waiting to be switched");
+  }
+  for (unsigned j=0; j<_num_gpios; j++) {
+    _seq_on[j] = 0;
+    _seq_off[j] = 0;
+  }
+}
+
+unsigned CommandRunner::num_pending_modules() const
+{
+  unsigned count = 0;
+  for (unsigned j=0; j<_num_gpios; j++) {
+    for (int i=0; i<GpioControl::NUM_MCB; i++) {
+      if (((_seq_on[j] | _seq_off[j]) >> i) & 1) count++;
+    }
+  }
+  return count;
+}
+
+long CommandRunner::step()
+{
+  // switching modules off goes first since it never waits on the supply
+  unsigned j = 0;
+  bool on = false;
+  while (j < _num_gpios && !_seq_off[j]) j++;
+  if (j == _num_gpios) {
+    on = true;
+    for (j=0; j<_num_gpios && !_seq_on[j]; j++) ;
+  }
+  if (j == _num_gpios) {
+    return -1;
+  } else if (!_seq_next.expired()) {
+    return _seq_next.remaining_ms() * 1000L;
+  }
+
+  unsigned& pending = on ? _seq_on[j] : _seq_off[j];
+  int i = 0;
+  while (!((pending >> i) & 1)) i++;
+
+  if (on && !((_gpio[j].get_mcb_active_mask() >> i) & 1)) {
+    // ACTIVE was changed since the module was queued
+    std::cerr << "Error: module " << i+1 << " of GPIO " << j
+              << " is no longer active, not enabling it" << std::endl;
+  } else if (on) {
+    // hold off while the supply is ramping or there's no room in the budget
+    bool ready = _gpio[j].get_dc_warning() == 0;
+    int current = 0;
+    if (ready && _budget && j < _num_ps && _ps[j].present()) {
+      current = _ps[j].get_current();
+      ready = current >= 0 && current + _seq_step[j] <= (long) _budget;
+    }
+    if (!ready) {
+      if (_seq_limit.expired()) {
+        std::stringstream msg;
+        msg << "Timed out waiting for supply " << j << " to enable modules!";
+        _logger->error(msg.str());
+        pending = 0;
+        _seq_limit = Deadline(_timeout);
+        return 0;
+      }
+      _seq_next = Deadline(BUDGET_SAMPLE);
+      return BUDGET_SAMPLE;
+    }
+    if (!_gpio[j].set_mcb(i+1, 1)) {
+      std::cerr << "Error: set_mcb(" << i+1 << ", 1) failed for GPIO " << j << std::endl;
+    } else if (_budget && j < _num_ps && _ps[j].present()) {
+      // the jump just after enabling is the best guess for the next module
+      int after = _ps[j].get_current();
+      if (after - current > _seq_step[j]) _seq_step[j] = after - current;
+    }
+  } else if (!_gpio[j].set_mcb(i+1, 0)) {
+    std::cerr << "Error: set_mcb(" << i+1 << ", 0) failed for GPIO " << j << std::endl;
+  }
+
+  pending &= ~(1u << i);
+  _seq_limit = Deadline(_timeout);
+  _seq_next = Deadline(_pause);
+  return num_pending_modules() ? (long) _pause : -1;
+}
+
+std::string CommandRunner::run_range(const std::string& type,
+                                     const std::string& prefix,
+                                     const std::string& cmd,
+                                     const std::string& value)
+{
+  unsigned count = 0;
+  if (type == PSCMD) {
+    count = _num_ps;
+  } else if (type == GFMCMD) {
+    count = _num_gfm;
+  } else if (type == FANCMD) {
+    count = _num_fan;
+  } else {
+    count = _num_gpios;
+  }
+
+  if (!value.empty() || cmd.empty() || cmd[cmd.length() - 1] != '?') {
+    std::cerr << "Error: only get commands can be sent to a range of devices: "
+              << prefix << std::endl;
+    return error(ERR_COMMAND);
+  }
+
+  // either every device of the type or an inclusive range such as GPIO0-3
+  unsigned first = 0;
+  unsigned last = count - 1;
+  std::string range = prefix.substr(type.length());
+  if (range.compare("*")) {
+    char* end = NULL;
+    first = std::strtoul(range.c_str(), &end, 0);
+    if (*end == '-') {
+      last = std::strtoul(end + 1, &end, 0);
+    }
+    if (*end != '\0' || first > last || last >= count) {
+      std::cerr << "Error: invalid device range: " << prefix << std::endl;
+      return error(ERR_INDEX);
+    }
+  } else if (!count) {
+    std::cerr << "Error: no devices to send the command to: " << prefix << std::endl;
+    return error(ERR_MISSING);
+  }
+
+  char dev[16];
+  std::string reply;
+  reply.reserve((last - first + 1) * 8);
+  for (unsigned i=first; i<=last; i++) {
+    bool present = true;
+    std::string single;
+    std::snprintf(dev, sizeof(dev), "%s%u", type.c_str(), i);
+    if (type == PSCMD) {
+      if ((present = _ps[i].present())) single = run_ps(dev, cmd, value);
+    } else if (type == GFMCMD) {
+      if ((present = _gfm[i].present())) single = run_gfm(dev, cmd, value);
+    } else if (type == FANCMD) {
+      if ((present = _fan[i].present())) single = run_fan(dev, cmd, value);
+    } else {
+      if ((present = _gpio[i].present())) single = run_gpios(dev, cmd, value);
+    }
+    // a missing device keeps its place so the values still line up
+    if (!present) {
+      reply += "NONE ";
+    } else if (is_error(single)) {
+      return single;
+    } else {
+      reply.append(single, 0, single.length() - 1);
+      reply += ' ';
+    }
+  }
+  reply[reply.length() - 1] = '\n';
+
+  return reply;
+}
+
 std::string CommandRunner::run_base(const std::string& cmd,
                                     const std::string& value)
 {
@@ -1106,52 +2148,83 @@ std::string CommandRunner::run_base(const std::string& cmd,
       return int_to_reply(_misc->get_powerswitch());
     } else if (!cmd.compare("INTERVAL?")) {
       return int_to_reply(_pause);
+    } else if (!cmd.compare("BUDGET?")) {
+      return int_to_reply(_budget);
     } else if (!cmd.compare("TIMEOUT?")) {
       return int_to_reply(_timeout);
     } else if (!cmd.compare("MODULES?")) {
       return int_to_reply(num_active_modules());
+    } else if (!cmd.compare("TOPOLOGY?")) {
+      return topology();
     } else if (!cmd.compare("STATE?")) {
       return state();
     } else if (!cmd.compare("BLOCK?")) {
       return lock_to_reply(_block);
+    } else if (!cmd.compare("PENDING?")) {
+      return int_to_reply(num_pending_modules());
     } else if (!cmd.compare("ON")) {
+      cancel_modules();
       return on();
     } else if (!cmd.compare("OFF")) {
+      cancel_modules();
       return off();
     } else if (!cmd.compare("TOGGLE")) {
+      cancel_modules();
       return toggle();
     } else if (cmd.empty() || cmd[cmd.length() - 1] == '?') {
       std::cerr << "Error: invalid get command received: "
                 << cmd << std::endl;
+      return error(ERR_COMMAND);
     } else {
       std::cerr << "Error: received a set command without a value" << std::endl;
+      return error(ERR_COMMAND);
     }
   } else {
     char* end = NULL;
     unsigned long ivalue = std::strtoul(value.c_str(), &end, 0);
     if (!cmd.compare("STATE")) {
       if (!value.compare("ON")) {
+        cancel_modules();
         return on(true);
       } else if (!value.compare("OFF")) {
+        cancel_modules();
         return off(true);
       } else {
         std::cerr << "Error: invalid value for STATE command: " << value << std::endl;
+        return error(ERR_VALUE);
       }
     } else if (!cmd.compare("BLOCK")) {
       if (!set_lock(_block, value)) {
         std::cerr << "Error: invalid value for BLOCK command: " << value << std::endl;
+        return error(ERR_VALUE);
       }
+    } else if (!cmd.compare("MODULES")) {
+      return run_modules(value);
     } else if (*end != '\0') {
       std::cerr << "Error: invalid led set command value: " << value << std::endl;
+      return error(ERR_VALUE);
     } else if (!cmd.compare("INTERVAL")) {
+      pthread_mutex_lock(&_settings_lock);
       _pause = ivalue;
+      pthread_mutex_unlock(&_settings_lock);
+      save();
     } else if (!cmd.compare("TIMEOUT")) {
+      pthread_mutex_lock(&_settings_lock);
       _timeout = ivalue;
+      pthread_mutex_unlock(&_settings_lock);
+      save();
+    } else if (!cmd.compare("BUDGET")) {
+      pthread_mutex_lock(&_settings_lock);
+      _budget = ivalue;
+      pthread_mutex_unlock(&_settings_lock);
+      save();
     } else if (cmd.empty() || cmd[cmd.length() - 1] != '?') {
       std::cerr << "Error: invalid set command received: "
                 << cmd  << std::endl;
+      return error(ERR_COMMAND);
     } else {
       std::cerr << "Error: received a get command with a value" << std::endl;
+      return error(ERR_COMMAND);
     }
   }
 
@@ -1205,11 +2278,12 @@ bool CommandRunner::is_on() const
 bool CommandRunner::check_enables() const
 {
   for (unsigned i=0; i<_num_gpios; i++) {
+    if (!_gpio[i].present()) continue;
     if (_state->is_set()) {
-      if (_gpio[i]->get_mcb_active_mask() != _gpio[i]->get_mcb_mask())
+      if (_gpio[i].get_mcb_active_mask() != _gpio[i].last_mcb_mask())
         return true;
     } else {
-      if(_gpio[i]->get_mcb_mask())
+      if(_gpio[i].last_mcb_mask())
         return true;
     }
   }
@@ -1221,13 +2295,236 @@ bool CommandRunner::check_ps() const
 {
   int expected = _state->is_set() ? 1 : 0;
   for (unsigned i=0; i<_num_ps; i++) {
-    if (_ps[i]->get_power() != expected)
+    if (!_ps[i].present()) continue;
+    if (_ps[i].last_power() != expected)
       return true;
   }
 
   return false;
 }
 
+std::string CommandRunner::topology() const
+{
+  std::stringstream reply;
+  for (unsigned i=0; i<_num_ps; i++) {
+    if (_ps[i].present()) reply << ' ' << PSCMD << i;
+  }
+  for (unsigned j=0; j<_num_gpios; j++) {
+    if (_gpio[j].present()) reply << ' ' << GPIOCMD << j;
+  }
+  for (unsigned k=0; k<_num_gfm; k++) {
+    if (_gfm[k].present()) reply << ' ' << GFMCMD << k;
+  }
+  for (unsigned l=0; l<_num_fan; l++) {
+    if (_fan[l].present()) reply << ' ' << FANCMD << l;
+  }
+
+  if (reply.str().empty()) {
+    return std::string("NONE\n");
+  } else {
+    return reply.str().substr(1) + '\n';
+  }
+}
+
+void CommandRunner::restore()
+{
+  Settings settings;
+  settings.pause = _pause;
+  settings.timeout = _timeout;
+  settings.budget = _budget;
+  settings.active.assign(_num_gpios, GpioControl::ALL_ON);
+  if (_saved->load(settings)) {
+    _pause = settings.pause;
+    _timeout = settings.timeout;
+    _budget = settings.budget;
+    for (unsigned j=0; j<_num_gpios; j++) {
+      _gpio[j].set_mcb_active_mask(settings.active[j]);
+    }
+    _logger->info("Restored saved interval, timeout, budget and active modules");
+  }
+}
+
+void CommandRunner::save() const
+{
+  Settings settings;
+  settings.pause = _pause;
+  settings.timeout = _timeout;
+  settings.budget = _budget;
+  for (unsigned j=0; j<_num_gpios; j++) {
+    settings.active.push_back(_gpio[j].get_mcb_active_mask());
+  }
+  if (!_saved->save(settings)) {
+    _logger->error("Failed to save the interval, timeout, budget and active modules!");
+  }
+}
+
+bool CommandRunner::enable_modules(unsigned id) const
+{
+  // without a budget, or a supply to measure, use the fixed interval
+  if (!_budget || id >= _num_ps || !_ps[id].present()) {
+    return set_modules(id, _gpio[id].get_mcb_active_mask(), "ON");
+  }
+
+  // the supply has to finish ramping before its current means anything
+  progress("ON " + GPIOCMD + int_to_str(id) + " SETTLE");
+  Deadline limit(_timeout);
+  Deadline next;
+  int last = -1;
+  int current = _ps[id].get_current();
+  while (last < 0 || current < 0 || std::abs(current - last) > SETTLE_TOLERANCE) {
+    if (limit.expired()) {
+      std::stringstream msg;
+      msg << "Supply " << id << " current did not settle before enabling modules!";
+      _logger->error(msg.str());
+      return false;
+    }
+    next.extend(SETTLE_SAMPLE);
+    next.sleep();
+    last = current;
+    current = _ps[id].get_current();
+  }
+
+  unsigned mask = _gpio[id].get_mcb_active_mask();
+  int step = 0;
+  for (int i=0; i<GpioControl::NUM_MCB; i++) {
+    if (!((mask>>i)&1)) {
+      if (!_gpio[id].set_mcb(i+1, 0))
+        return false;
+      continue;
+    }
+
+    // wait for room in the budget for the inrush of one more module
+    progress("ON " + GPIOCMD + int_to_str(id) + " MCB" + int_to_str(i+1));
+    limit = Deadline(_timeout);
+    next = Deadline();
+    current = _ps[id].get_current();
+    while (current < 0 || current + step > (long) _budget) {
+      if (limit.expired()) {
+        std::stringstream msg;
+        msg << "Supply " << id << " current " << current << " mA leaves no room in the "
+            << _budget << " mA budget to enable module " << i+1 << "!";
+        _logger->error(msg.str());
+        return false;
+      }
+      next.extend(BUDGET_SAMPLE);
+      next.sleep();
+      current = _ps[id].get_current();
+    }
+
+    if (!_gpio[id].set_mcb(i+1, 1))
+      return false;
+
+    // the jump just after enabling is the best guess for the next module
+    int after = _ps[id].get_current();
+    if (after - current > step) step = after - current;
+  }
+
+  return true;
+}
+
+bool CommandRunner::set_modules(unsigned id, unsigned mask, const std::string& what) const
+{
+  // the same pacing as set_mcb_mask, with each module its own step
+  Deadline next;
+  for (int i=0; i<GpioControl::NUM_MCB; i++) {
+    progress(what + ' ' + GPIOCMD + int_to_str(id) + " MCB" + int_to_str(i+1));
+    if (!_gpio[id].set_mcb(i+1, (mask>>i)&1))
+      return false;
+    next.extend(_pause);
+    next.sleep();
+  }
+  return true;
+}
+
+void CommandRunner::check_alarms()
+{
+  bool tripped = false;
+  for (unsigned i=0; i<_alarms.size(); i++) {
+    Alarm& alarm = _alarms[i];
+    int value;
+    if (!alarm.enabled()) continue;
+
+    // nothing to watch, e.g. the current of a supply that is off
+    if (!sample(alarm, value)) {
+      if (alarm.level() != Alarm::OK) {
+        _logger->info("Alarm " + alarm.name() + " is no longer monitored");
+        alarm.reset();
+      }
+      continue;
+    }
+
+    if (alarm.update(value)) {
+      std::stringstream msg;
+      msg << "Alarm " << alarm.name() << " is " << Alarm::LEVELS[alarm.level()]
+          << " at " << value;
+      if (alarm.level() == Alarm::OK) {
+        _logger->info(msg.str());
+      } else {
+        _logger->error(msg.str());
+      }
+    }
+    if (alarm.level() != Alarm::OK) tripped = true;
+  }
+
+  // keep the detector off for as long as anything is out of range
+  if (tripped && _alarm_action != Alarm::NONE) {
+    cancel_modules();
+    if (!is_off()) {
+      _logger->error("Powering off the detector because of an alarm");
+      off();
+    }
+    if (_alarm_action == Alarm::BLOCK && !_block->is_set()) {
+      _logger->error("Blocking the detector because of an alarm");
+      set_lock(_block, "SET");
+    }
+  }
+}
+
+bool CommandRunner::sample(const Alarm& alarm, int& value) const
+{
+  unsigned idx = alarm.index();
+  switch (alarm.source()) {
+  case PS_TEMP:
+    if (!_ps[idx].present()) return false;
+    value = _ps[idx].get_temp();
+    return true;
+  case PS_VOLT:
+  case PS_CURR:
+    // an unpowered supply is expected to read low
+    if (!_ps[idx].present() || _ps[idx].last_power() <= 0) return false;
+    value = alarm.source() == PS_VOLT ? _ps[idx].get_voltage() : _ps[idx].get_current();
+    return true;
+  case GFM_FLOW:
+    if (!_gfm[idx].present()) return false;
+    value = _gfm[idx].get_flow();
+    return true;
+  case GFM_TEMP:
+    if (!_gfm[idx].present()) return false;
+    value = _gfm[idx].get_temp();
+    return true;
+  case FAN_INPUT:
+    if (!_fan[idx].present()) return false;
+    value = _fan[idx].get_input();
+    return true;
+  default:
+    return false;
+  }
+}
+
+Alarm* CommandRunner::find_alarm(const std::string& cmd, std::string& setting)
+{
+  for (unsigned i=0; i<_alarms.size(); i++) {
+    const std::string& name = _alarms[i].name();
+    if (check_cmd(name, cmd) && cmd.length() > name.length() &&
+        (cmd[name.length()] == ':' || cmd[name.length()] == '?')) {
+      setting = cmd.substr(name.length());
+      return &_alarms[i];
+    }
+  }
+
+  return NULL;
+}
+
 bool CommandRunner::set_lock(const Lock* lock, const std::string& value) const
 {
   if (!value.compare("SET")) { 
@@ -1274,6 +2571,33 @@ bool CommandRunner::is_led_cmd(const std::string& cmd) const
   return check_cmd(LEDCMD, cmd);
 }
 
+bool CommandRunner::is_bme_cmd(const std::string& cmd) const
+{
+  return check_cmd(BMECMD, cmd);
+}
+
+bool CommandRunner::is_alarm_cmd(const std::string& cmd) const
+{
+  return check_cmd(ALARMCMD, cmd);
+}
+
+bool CommandRunner::is_cached_cmd(const std::string& cmd) const
+{
+  // only getters of values that are kept in memory
+  if (cmd.empty() || cmd[cmd.length() - 1] != '?' || cmd.find(' ') != std::string::npos) {
+    return false;
+  } else if (is_bme_cmd(cmd)) {
+    return true;
+  } else if (is_gpio_cmd(cmd)) {
+    size_t cpos = cmd.find(":");
+    return cpos != std::string::npos && check_cmd("ACTIVE", cmd.substr(cpos+1));
+  } else {
+    return !cmd.compare("*IDN?") || !cmd.compare("INTERVAL?") || !cmd.compare("BUDGET?") ||
+           !cmd.compare("TIMEOUT?") || !cmd.compare("MODULES?") ||
+           !cmd.compare("TOPOLOGY?");
+  }
+}
+
 bool CommandRunner::is_mcb_cmd(const std::string& cmd) const
 {
   unsigned idx = 0;
@@ -1292,6 +2616,11 @@ bool CommandRunner::is_warn_cmd(const std::string& cmd) const
   return check_cmd(WARNCMD, cmd);
 }
 
+bool CommandRunner::is_range_cmd(const std::string& type, const std::string& prefix) const
+{
+  return prefix.find_first_of("*-", type.length()) != std::string::npos;
+}
+
 bool CommandRunner::check_cmd(const std::string& type, const std::string& cmd) const
 {
   return !cmd.compare(0, type.length(), type, 0, type.length());
@@ -1331,7 +2660,8 @@ unsigned CommandRunner::num_active_modules() const
 {
   unsigned num_active = 0;
   for (unsigned i=0; i<_num_gpios; i++) {
-    num_active += _gpio[i]->num_mcb_active();
+    if (!_gpio[i].present()) continue;
+    num_active += _gpio[i].num_mcb_active();
   }
 
   return num_active;
@@ -1,10 +1,21 @@
 #ifndef Pds_Jungfrau_Reader_hh
 #define Pds_Jungfrau_Reader_hh
 
+#include "Alarm.hh"
+#include "Timer.hh"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <new>
 #include <string>
+#include <vector>
 
 namespace Pds {
   namespace Jungfrau {
+    class Backend;
+    class LoopStats;
+    struct Config;
+
     class File {
     public:
       File(std::string path, std::string name, const char sep='/');
@@ -46,64 +57,166 @@ namespace Pds {
       bool is_set() const;
       bool set() const;
       bool clear() const;
+      void invalidate() const;
 
     private:
       bool read_flag() const;
       bool write_flag(bool flag) const;
+
+    private:
+      mutable int _cached;
     };
 
-    class Control {
-    protected:
-      Control(std::string path, std::string type, std::string dev);
-      virtual ~Control();
-      std::string read_raw_value(std::string cmd, int id=-1) const;
-      int read_value(std::string cmd, int id=-1) const;
-      bool wait_value(int value, std::string cmd, unsigned long timeout, int id=-1) const;
-      bool write_value(unsigned value, std::string cmd, int id=-1) const;
+    struct Settings {
+      unsigned long         pause;
+      unsigned long         timeout;
+      unsigned long         budget;
+      std::vector<unsigned> active;
+    };
+
+    class StateFile : public File {
+    public:
+      StateFile(std::string path, std::string name);
+      ~StateFile();
+      bool load(Settings& settings) const;
+      bool save(const Settings& settings) const;
+
+      static const uint32_t MAGIC = 0x4a465053; // JFPS
+      static const uint32_t VERSION = 2;
+
+    private:
+      uint32_t checksum(const std::vector<uint32_t>& record) const;
+      bool sync_dir() const;
+
+    private:
+      std::string                   _path;
+      mutable std::vector<uint32_t> _last;
+    };
+
+    /*
+     * Fixed size array that keeps the devices next to each other rather
+     * than behind separately allocated pointers.
+     */
+    template <class T>
+    class Devices {
+    public:
+      explicit Devices(unsigned capacity) :
+        _size(0),
+        _capacity(capacity),
+        _data(static_cast<T*>(::operator new(capacity * sizeof(T))))
+      {}
+      ~Devices()
+      {
+        for (unsigned i=0; i<_size; i++) {
+          _data[i].~T();
+        }
+        ::operator delete(_data);
+      }
+      void add(const T& device)
+      {
+        if (_size < _capacity) {
+          new (&_data[_size++]) T(device);
+        }
+      }
+      // moves the devices to a larger array, keeping their state
+      void reserve(unsigned capacity)
+      {
+        if (capacity <= _capacity) return;
+        T* data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+        for (unsigned i=0; i<_size; i++) {
+          new (&data[i]) T(_data[i]);
+          _data[i].~T();
+        }
+        ::operator delete(_data);
+        _data = data;
+        _capacity = capacity;
+      }
+      void truncate(unsigned size)
+      {
+        while (_size > size) {
+          _data[--_size].~T();
+        }
+      }
+      unsigned size() const { return _size; }
+      T& operator[](unsigned index) { return _data[index]; }
+      const T& operator[](unsigned index) const { return _data[index]; }
 
     private:
-      std::string filename(std::string cmd, int id) const;
+      Devices(const Devices&);
+      Devices& operator=(const Devices&);
 
     private:
-      const char  _sep;
-      std::string _path;
-      std::string _type;
-      std::string _dev;
+      unsigned _size;
+      unsigned _capacity;
+      T*       _data;
+    };
+
+    class Control {
+    public:
+      bool present() const;
+
+    protected:
+      Control(Backend* backend,
+              std::string type,
+              std::string dev,
+              int id,
+              const char* const* attrs,
+              unsigned nattrs);
+      ~Control();
+      std::string read_raw_value(unsigned attr) const;
+      int read_value(unsigned attr) const;
+      bool wait_value(int value, unsigned attr, unsigned long timeout) const;
+      bool write_value(unsigned value, unsigned attr) const;
+      bool probe();
+
+      static const long WAIT_SAMPLE = 1000;     // us
+
+    private:
+      Backend*                 _backend;
+      std::string              _prefix;
+      std::vector<std::string> _keys;
+      bool                     _present;
     };
 
     class PowerControl : public Control {
     public:
-      PowerControl(std::string path, const int id=0);
-      virtual ~PowerControl();
+      PowerControl(Backend* backend, const int id=0);
+      ~PowerControl();
 
       bool set_power(unsigned value) const;
       int get_power() const;
+      int last_power() const;
       int get_temp() const;
       int get_voltage() const;
       int get_current() const;
       std::string get_name() const;
 
     private:
-      const int _id;
+      enum Attr { SET_POWER, TEMP, VOLT, CURR, NAME, NUM_ATTRS };
+      static const char* const ATTRS[];
+
+    private:
+      mutable int _power;
     };
 
     class FlowMeterControl : public Control {
     public:
-      FlowMeterControl(std::string path, const int id=0);
-      virtual ~FlowMeterControl();
+      FlowMeterControl(Backend* backend, const int id=0);
+      ~FlowMeterControl();
 
       int get_temp() const;
       int get_flow() const;
       std::string get_name() const;
 
     private:
-      const int _id;
+      enum Attr { TEMP, FLOW, NAME, NUM_ATTRS };
+      static const char* const ATTRS[];
     };
 
     class FanControl : public Control {
     public:
-      FanControl(std::string path, const int id=0);
-      virtual ~FanControl();
+      FanControl(Backend* backend, const int id=0);
+      ~FanControl();
 
       int get_input() const;
       int get_target() const;
@@ -111,13 +224,14 @@ namespace Pds {
       std::string get_name() const;
 
     private:
-      const int _id;
+      enum Attr { INPUT, TARGET, DIV, NAME, NUM_ATTRS };
+      static const char* const ATTRS[];
     };
 
     class LedControl : public Control {
     public:
-      LedControl(std::string path);
-      virtual ~LedControl();
+      LedControl(Backend* backend);
+      ~LedControl();
 
       bool set_led(unsigned mask) const;
       unsigned get_led() const;
@@ -127,12 +241,16 @@ namespace Pds {
       bool set_led_green(unsigned value) const;
       bool set_led_red(unsigned value) const;
       bool set_led_yellow(unsigned value) const;
+
+    private:
+      enum Attr { GREEN, RED, YELLOW, NUM_ATTRS };
+      static const char* const ATTRS[];
     };
 
     class MiscControl : public Control {
     public:
-      MiscControl(std::string path);
-      virtual ~MiscControl();
+      MiscControl(Backend* backend);
+      ~MiscControl();
 
       int get_autostart_enable() const;
       int get_fanctrl_enable() const;
@@ -140,12 +258,44 @@ namespace Pds {
       int get_inhibit() const;
       int get_inhibit_enable() const;
       int get_powerswitch() const;
+
+    private:
+      enum Attr { AUTOSTART, FANCTRL, FLOWMETER, INHIBIT, INHIBIT_ENABLE, POWERSWITCH, NUM_ATTRS };
+      static const char* const ATTRS[];
+    };
+
+    class BmeControl {
+    public:
+      enum Value { TEMP, HUMID, PRESS, ALT, NUM_VALUES };
+      BmeControl(std::string device);
+      ~BmeControl();
+
+      bool open();
+      void close();
+      int fd() const;
+      bool process();
+      bool has_value(Value value) const;
+      double get_value(Value value) const;
+
+      static const char* const LABELS[];
+
+    private:
+      void parse(const char* line);
+
+    private:
+      std::string _device;
+      mutable pthread_mutex_t _lock;
+      int         _fd;
+      size_t      _len;
+      bool        _valid[NUM_VALUES];
+      double      _values[NUM_VALUES];
+      char        _buf[256];
     };
 
     class GpioControl : public Control {
     public:
-      GpioControl(std::string path, const int id=0);
-      virtual ~GpioControl();
+      GpioControl(Backend* backend, const int id=0);
+      ~GpioControl();
 
       int get_ac_warning() const;
       int get_dc_warning() const;
@@ -159,6 +309,7 @@ namespace Pds {
       unsigned num_mcb_active() const;
       int get_mcb(const int id) const;
       int get_mcb_mask() const;
+      int last_mcb_mask() const;
       int get_mcb_active(const int id) const;
       int get_mcb_active_mask() const;
       bool set_mcb(const int id, unsigned value) const;
@@ -173,24 +324,66 @@ namespace Pds {
       static const int ALL_ON = (1<<NUM_MCB) - 1;
 
     private:
-      std::string mcbcmd(int id) const;
+      // the enables of modules 1 to NUM_MCB follow the other attributes
+      enum Attr { AC_WARNING, DC_WARNING, TEMP_WARNING, PS_ONOFF, MCB1, NUM_ATTRS=MCB1+NUM_MCB };
+      static const char* const ATTRS[];
+
+    private:
+      unsigned    _active;
+      mutable int _mask;
+    };
+
+    class Runner {
+    public:
+      // the error codes sent back as "ERR <code> <name>"
+      enum Error { ERR_NONE, ERR_COMMAND, ERR_INDEX, ERR_VALUE, ERR_MISSING,
+                   ERR_DEVICE, ERR_INTERLOCKED, ERR_BUSY, NUM_ERRORS };
+      static const char* const ERRORS[];
+
+      virtual ~Runner();
+      virtual std::string run(const std::string& cmd) = 0;
+      virtual bool cached(const std::string& cmd, std::string& reply) = 0;
+      virtual void verify() = 0;
+      virtual void metrics(std::string& page) const = 0;
+      // runs any background work that is due, and returns the us until
+      // it should be called again or -1 when there is nothing left to do
+      virtual long step() = 0;
+      // applies a reloaded configuration between requests
+      virtual void configure(const Config& config) = 0;
+      void watch(LoopStats* stats);
+
+      static std::string error(Error code);
+      static bool is_error(const std::string& reply);
+      static bool expects_reply(const std::string& cmd);
+
+    protected:
+      Runner();
+      // marks a step of a long command so it isn't taken for a stall
+      void progress(const std::string& what) const;
 
     private:
-      const int _id;
-      unsigned  _active;
+      LoopStats* _stats;
     };
 
-    class CommandRunner {
+    class CommandRunner : public Runner {
     public:
       CommandRunner(std::string name,
-                    std::string path,
+                    Backend* backend,
                     std::string logpath,
                     const unsigned num_ps,
                     const unsigned num_gpios,
                     const unsigned num_gfm,
-                    const unsigned num_fan);
-      ~CommandRunner();
-      std::string run(const std::string& cmd);
+                    const unsigned num_fan,
+                    BmeControl* bme=NULL,
+                    const bool snapshots=false,
+                    const bool rechecks=false);
+      virtual ~CommandRunner();
+      virtual std::string run(const std::string& cmd);
+      virtual bool cached(const std::string& cmd, std::string& reply);
+      virtual void verify();
+      virtual void metrics(std::string& page) const;
+      virtual long step();
+      virtual void configure(const Config& config);
 
     private:
       std::string on(bool verbose=false) const;
@@ -202,6 +395,8 @@ namespace Pds {
       std::string state() const;
       std::string run_led(const std::string& cmd,
                           const std::string& value) const;
+      std::string run_bme(const std::string& cmd,
+                          const std::string& value) const;
       std::string run_ps(const std::string& prefix,
                          const std::string& cmd,
                          const std::string& value) const;
@@ -213,21 +408,50 @@ namespace Pds {
                            const std::string& value) const;
       std::string run_gpios(const std::string& prefix,
                             const std::string& cmd,
-                            const std::string& value) const;
+                            const std::string& value);
+      std::string run_alarm(const std::string& cmd,
+                            const std::string& value);
+      std::string run_modules(const std::string& value);
+      void cancel_modules();
+      unsigned num_pending_modules() const;
+      std::string run_range(const std::string& type,
+                            const std::string& prefix,
+                            const std::string& cmd,
+                            const std::string& value);
       std::string run_base(const std::string& cmd,
                            const std::string& value);
+      std::string topology() const;
       bool is_off() const;
       bool is_on() const;
       bool check_enables() const;
       bool check_ps() const;
+      void restore();
+      void save() const;
+      bool enable_modules(unsigned id) const;
+      bool set_modules(unsigned id, unsigned mask, const std::string& what) const;
+      void resize(const unsigned num_ps,
+                  const unsigned num_gpios,
+                  const unsigned num_gfm,
+                  const unsigned num_fan);
+      void add_alarm(std::vector<Alarm>& alarms, const Alarm& alarm) const;
+      void snapshot();
+      void record(unsigned& index, const char* metric, const char* label,
+                  const std::string& id, double value, bool valid=true);
+      void check_alarms();
+      bool sample(const Alarm& alarm, int& value) const;
+      Alarm* find_alarm(const std::string& cmd, std::string& setting);
       bool set_lock(const Lock* lock, const std::string& value) const;
       bool is_ps_cmd(const std::string& cmd) const;
       bool is_gfm_cmd(const std::string& cmd) const;
       bool is_fan_cmd(const std::string& cmd) const;
       bool is_gpio_cmd(const std::string& cmd) const;
       bool is_led_cmd(const std::string& cmd) const;
+      bool is_bme_cmd(const std::string& cmd) const;
+      bool is_alarm_cmd(const std::string& cmd) const;
+      bool is_cached_cmd(const std::string& cmd) const;
       bool is_mcb_cmd(const std::string& cmd) const;
       bool is_warn_cmd(const std::string& cmd) const;
+      bool is_range_cmd(const std::string& type, const std::string& prefix) const;
       bool check_cmd(const std::string& type, const std::string& cmd) const;
       std::string get_mcb_prefix(const std::string& cmd) const;
       int get_mcb_index(const std::string& cmd,
@@ -240,30 +464,61 @@ namespace Pds {
       static const std::string FANCMD;
       static const std::string GPIOCMD;
       static const std::string LEDCMD;
+      static const std::string BMECMD;
+      static const std::string ALARMCMD;
       static const std::string WARNCMD;
       static const std::string MCBCMDS[];
+      static const long BUDGET_SAMPLE = 1000;   // us
+      static const long SETTLE_SAMPLE = 10000;  // us
+      static const int SETTLE_TOLERANCE = 5;    // mA
+
+    private:
+      // the values that can have an alarm on them
+      enum Source { PS_TEMP, PS_VOLT, PS_CURR, GFM_FLOW, GFM_TEMP, FAN_INPUT };
 
     private:
-      const unsigned     _num_ps;
-      const unsigned     _num_gpios;
-      const unsigned     _num_gfm;
-      const unsigned     _num_fan;
+      unsigned           _num_ps;
+      unsigned           _num_gpios;
+      unsigned           _num_gfm;
+      unsigned           _num_fan;
       std::string        _name;
+      std::string        _logpath;
       unsigned long      _pause;
       unsigned long      _timeout;
+      unsigned long      _budget;
+      mutable pthread_mutex_t _settings_lock;
       Flag*              _state;
       Lock*              _block;
+      StateFile*         _saved;
       Logger*            _logger;
+      Backend*           _backend;
       LedControl*        _led;
       MiscControl*       _misc;
-      PowerControl**     _ps;
-      Lock**             _ps_temp;
-      GpioControl**      _gpio;
-      FlowMeterControl** _gfm;
-      Lock**             _gfm_flow;
-      Lock**             _gfm_temp;
-      FanControl**       _fan;
-      Lock**             _fan_input;
+      BmeControl*        _bme;
+      Devices<PowerControl>     _ps;
+      Devices<Lock>             _ps_temp;
+      Devices<GpioControl>      _gpio;
+      Devices<FlowMeterControl> _gfm;
+      Devices<Lock>             _gfm_flow;
+      Devices<Lock>             _gfm_temp;
+      Devices<FanControl>       _fan;
+      Devices<Lock>             _fan_input;
+      std::vector<Alarm>        _alarms;
+      Alarm::Action             _alarm_action;
+      // alarms are only checked by the -V recheck
+      const bool                _rechecks;
+      // the readings from the last recheck, for the metrics page
+      const bool                _snapshots;
+      mutable pthread_mutex_t   _snapshot_lock;
+      std::vector<std::string>  _metric_names;
+      std::vector<double>       _metric_values;
+      std::vector<double>       _samples;
+      // modules waiting to be switched by the sequencer, one mask per gpio
+      std::vector<unsigned>     _seq_on;
+      std::vector<unsigned>     _seq_off;
+      std::vector<int>          _seq_step;
+      Deadline                  _seq_next;
+      Deadline                  _seq_limit;
     };
   }
 }
@@ -1,23 +1,83 @@
 #include "Server.hh"
+#include "Listener.hh"
 #include "Reader.hh"
 #include "Simulator.hh"
+#include "Worker.hh"
 
 #include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <csignal>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 using namespace Pds::Jungfrau;
 
-Connection::Connection(int fd, CommandRunner* cmd, const unsigned bufsz) :
+SocketOptions::SocketOptions() :
+  nodelay(false),
+  keepidle(0),
+  keepintvl(0),
+  keepcnt(0),
+  bufsize(0)
+{}
+
+bool SocketOptions::apply(int fd) const
+{
+  int opt = 1;
+  bool ok = true;
+
+  // the replies are short lines, so don't let Nagle hold them back
+  if (nodelay && ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+    std::perror("Error: setsockopt TCP_NODELAY failed on connection socket");
+    ok = false;
+  }
+  // probe silent peers so a dead IOC doesn't hold on to a connection
+  if (keepidle) {
+    int idle = keepidle;
+    int intvl = keepintvl ? keepintvl : keepidle;
+    int cnt = keepcnt ? keepcnt : 3;
+    if (::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) < 0 ||
+        ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+        ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0 ||
+        ::setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) < 0) {
+      std::perror("Error: setsockopt SO_KEEPALIVE failed on connection socket");
+      ok = false;
+    }
+  }
+  if (bufsize) {
+    int size = bufsize;
+    if (::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0 ||
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+      std::perror("Error: setsockopt SO_RCVBUF/SO_SNDBUF failed on connection socket");
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+Connection::Connection(unsigned id, unsigned long gen, int fd,
+                       Runner* cmd, Batch* batch, Counters* counters,
+                       const Watchdog* watchdog, const unsigned long idle,
+                       const unsigned bufsz) :
+  _id(id),
+  _gen(gen),
+  _idle(idle),
   _bufsz(bufsz),
   _overflow(false),
   _fd(fd),
   _wpos(NULL),
   _buf(new char[bufsz]),
-  _cmd(cmd)
+  _cmd(cmd),
+  _batch(batch),
+  _counters(counters),
+  _watchdog(watchdog),
+  _inflight(0),
+  _expiry(idle)
 {
   _wpos = _buf;
 }
@@ -28,6 +88,13 @@ Connection::~Connection()
   if (_buf) {
     delete[] _buf;
   }
+  // requests still with the worker are cleaned up by the server
+  while (!_pending.empty()) {
+    if (_pending.front()->done) {
+      delete _pending.front();
+    }
+    _pending.pop_front();
+  }
 }
 
 void Connection::shutdown()
@@ -43,10 +110,35 @@ bool Connection::closed() const
   return _fd < 0;
 }
 
+bool Connection::busy() const
+{
+  return _pending.size() >= MAX_PENDING;
+}
+
+bool Connection::idle() const
+{
+  // a connection still waiting on its replies isn't idle
+  return _idle && _pending.empty() && _expiry.expired();
+}
+
+int Connection::idle_ms() const
+{
+  if (!_idle || !_pending.empty()) {
+    return -1;
+  }
+  return _expiry.remaining_ms();
+}
+
+bool Connection::matches(const Request* req) const
+{
+  return req->conn == _id && req->gen == _gen;
+}
+
 bool Connection::process()
 {
   int nread = ::recv(_fd, _wpos, _bufsz - (_wpos - _buf) - 1, 0);
   if(nread > 0) {
+    _expiry = Deadline(_idle);
     // null-terminated the buffer
     _wpos[nread] = '\0';
     if (!parse())
@@ -68,21 +160,81 @@ std::string Connection::buffer_to_str(char* buffer) const
   return std::string(buffer, strlen(buffer));
 }
 
+std::string Connection::tagged(const Request* req) const
+{
+  // every tagged command gets a reply, including the setters
+  if (!req->reply.empty()) {
+    return req->tag + ' ' + req->reply;
+  } else if (!req->cmd.empty() && req->cmd[req->cmd.length() - 1] != '?') {
+    return req->tag + " OK\n";
+  } else {
+    return req->tag + ' ' + Runner::error(Runner::ERR_COMMAND);
+  }
+}
+
 bool Connection::reply(std::string cmd)
 {
-  if (_cmd) {
-    std::string reply = _cmd->run(cmd);
-    if (::send(_fd, reply.c_str(), reply.length(), 0) < 0) {
-      std::perror("Error: socket send failed!");
-      return false;
+  if (_cmd && _batch) {
+    std::string tag;
+    // a command starting with #<id> is a tagged one
+    if (!cmd.empty() && cmd[0] == '#') {
+      size_t spos = cmd.find(' ');
+      tag = cmd.substr(0, spos);
+      cmd = spos == std::string::npos ? std::string("") : cmd.substr(spos + 1);
+    }
+    Request* req = new Request(_id, _gen, cmd, tag);
+    _counters->commands++;
+    // the health queries have to be answered even with the worker stuck,
+    // and cached getters can skip it unless that would reorder replies
+    if (_watchdog->query(cmd, req->reply)) {
+      req->done = true;
+    } else if (!_inflight && _cmd->cached(cmd, req->reply)) {
+      req->done = true;
+      _counters->cached++;
     } else {
-      return true;
+      _batch->add(req);
+      _inflight++;
     }
+    _pending.push_back(req);
+    return flush();
   } else {
     return false;
   }
 }
 
+bool Connection::complete(Request* req)
+{
+  req->done = true;
+  _inflight--;
+  return flush();
+}
+
+bool Connection::flush()
+{
+  // replies go out in the order the commands arrived
+  while (!_pending.empty() && _pending.front()->done) {
+    Request* req = _pending.front();
+    _pending.pop_front();
+    std::string reply = req->tag.empty() ? req->reply : tagged(req);
+    // untagged setters have no reply for a client to read an error from
+    if (req->tag.empty() && Runner::is_error(reply) && !Runner::expects_reply(req->cmd)) {
+      reply.clear();
+    }
+    if (!reply.empty() &&
+        ::send(_fd, reply.c_str(), reply.length(), 0) < 0) {
+      std::perror("Error: socket send failed!");
+      delete req;
+      return false;
+    }
+    delete req;
+  }
+  // the idle time counts from the last reply as well as the last command
+  if (_pending.empty()) {
+    _expiry = Deadline(_idle);
+  }
+  return true;
+}
+
 bool Connection::parse()
 {
   bool partial = _buf[strlen(_buf) - 1] != '\n';
@@ -119,34 +271,98 @@ bool Connection::parse()
 }
 
 
-Server::Server(std::string name,
-               std::string path,
+Server::Server(const Config& config,
+               Backend* backend,
                std::string block,
-               const unsigned port,
-               const unsigned max_conns,
+               const std::vector<std::string>& listen,
                Simulator* sim,
-               const unsigned num_ps,
-               const unsigned num_gpios,
-               const unsigned num_gfm,
-               const unsigned num_fan) :
-  _max_conns(max_conns),
-  _server_idx(0),
-  _conn_idx(1),
+               std::string bme,
+               const unsigned verify,
+               const unsigned metrics,
+               const unsigned queue,
+               const unsigned idle,
+               const SocketOptions& sockopts,
+               const WatchdogOptions& watchdog) :
+  _max_conns(config.conns),
+  _nslots(config.conns),
+  _max_queue(queue),
+  _idle(idle * 1000000UL),
+  _sockopts(sockopts),
+  _nlisteners(listen.size()),
+  _sim_idx(_nlisteners),
+  _bme_idx(sim ? _sim_idx + Simulator::NFDS : _sim_idx),
+  _worker_idx(bme.empty() ? _bme_idx : _bme_idx + 1),
+  _signal_idx(_worker_idx + 1),
+  _metrics_idx(_signal_idx + 1),
+  _conn_idx(metrics ? _metrics_idx + Metrics::NFDS : _metrics_idx),
   _up(false),
-  _nfds(max_conns + 1),
+  _nfds(_nslots + _conn_idx),
   _nconns(0),
-  _server_fd(-1),
+  _gen(0),
   _sim(sim),
-  _cmd(new CommandRunner(name, path, block, num_ps, num_gpios, num_gfm, num_fan)),
-  _conns(new Connection*[max_conns]),
-  _pfds(new pollfd[max_conns + 1]),
+  _bme(bme.empty() ? NULL : new BmeControl(bme)),
+  _cmd(new CommandRunner(config.name, backend, block, config.boards, config.boards,
+                         config.gfms, config.fans, _bme, metrics != 0, verify != 0)),
+  _watchdog(new Watchdog(watchdog)),
+  _worker(new Worker(_cmd, &_watchdog->worker(),
+                     _nslots * (Connection::MAX_PENDING + Connection::BUFSZ / 2), verify)),
+  _batch(new Batch(_worker)),
+  _metrics(metrics ? new Metrics(_cmd, &_counters) : NULL),
+  _config(config),
+  _conns(new Connection*[_nslots]),
+  _pfds(new pollfd[_nfds]),
   _conn_pfds(NULL)
 {
-  struct sockaddr_in address;
-  int opt = 1;
+  setup(listen, metrics);
+}
+
+Server::Server(Runner* runner,
+               const Config& config,
+               const std::vector<std::string>& listen,
+               const unsigned verify,
+               const unsigned metrics,
+               const unsigned queue,
+               const unsigned idle,
+               const SocketOptions& sockopts,
+               const WatchdogOptions& watchdog) :
+  _max_conns(config.conns),
+  _nslots(config.conns),
+  _max_queue(queue),
+  _idle(idle * 1000000UL),
+  _sockopts(sockopts),
+  _nlisteners(listen.size()),
+  _sim_idx(_nlisteners),
+  _bme_idx(_sim_idx),
+  _worker_idx(_bme_idx),
+  _signal_idx(_worker_idx + 1),
+  _metrics_idx(_signal_idx + 1),
+  _conn_idx(metrics ? _metrics_idx + Metrics::NFDS : _metrics_idx),
+  _up(false),
+  _nfds(_nslots + _conn_idx),
+  _nconns(0),
+  _gen(0),
+  _sim(NULL),
+  _bme(NULL),
+  _cmd(runner),
+  _watchdog(new Watchdog(watchdog)),
+  _worker(new Worker(_cmd, &_watchdog->worker(),
+                     _nslots * (Connection::MAX_PENDING + Connection::BUFSZ / 2), verify)),
+  _batch(new Batch(_worker)),
+  _metrics(metrics ? new Metrics(_cmd, &_counters) : NULL),
+  _config(config),
+  _conns(new Connection*[_nslots]),
+  _pfds(new pollfd[_nfds]),
+  _conn_pfds(NULL)
+{
+  setup(listen, metrics);
+}
+
+void Server::setup(const std::vector<std::string>& listen, const unsigned metrics)
+{
+  bool listening = true;
 
   // NULL the pointers in the _conns array
-  for (unsigned n=0; n<max_conns; n++) {
+  for (unsigned n=0; n<_nslots; n++) {
     _conns[n] = NULL;
   }
   // set the conn pfds pointer
@@ -157,76 +373,121 @@ Server::Server(std::string name,
     _pfds[i].events   = POLLIN;
     _pfds[i].revents  = 0;
   }
+  // add the simulator fds to the poller
+  if (_sim) {
+    _sim->setup(_pfds + _sim_idx);
+  }
+  // add the BME serial port to the poller
+  if (_bme && _bme->open()) {
+    _pfds[_bme_idx].fd = _bme->fd();
+  }
+  // add the worker completion notifications to the poller
+  _pfds[_worker_idx].fd = _worker->fd();
+  // take SIGHUP as a request to reload the config file, before the worker
+  // thread starts so that it inherits the blocked signal
+  if (!_config.file.empty()) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL)) {
+      std::cerr << "Error: failed to block SIGHUP for config reloads" << std::endl;
+    } else if ((_pfds[_signal_idx].fd = ::signalfd(-1, &mask, SFD_NONBLOCK)) < 0) {
+      std::perror("Error: signalfd creation failed for config reloads");
+    }
+  }
+  // add the metrics listener and its scrapers to the poller
+  if (_metrics && _metrics->listen(metrics)) {
+    _metrics->setup(_pfds + _metrics_idx);
+  }
 
-  // setup the address
-  address.sin_family = AF_INET;
-  address.sin_addr.s_addr = INADDR_ANY;
-  address.sin_port = htons(port);
-
-  _server_fd = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (_server_fd < 0) {
-    std::perror("Error: server socket creation failed");
-  } else {
-    if (::setsockopt(_server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-      std::perror("Error: setsockopt failed on server socket");
+  // add every socket the control connections come in on to the poller
+  for (unsigned i=0; i<_nlisteners; i++) {
+    Listener* listener = Listener::create(listen[i]);
+    if (!listener) {
+      std::cerr << "Error: invalid listener " << listen[i] << std::endl;
+      listening = false;
     } else {
-      if (::bind(_server_fd, (struct sockaddr *)&address, sizeof(address))<0) {
-        std::perror("Error: bind failed for server socket"); 
+      _listeners.push_back(listener);
+      if (listener->open(_max_conns + _max_queue)) {
+        _pfds[i].fd = listener->fd();
       } else {
-        if (::listen(_server_fd, _max_conns) < 0) {
-          std::perror("Error: listen failed for server socket");
-        } else {
-          // add server fd to poller
-          _pfds[_server_idx].fd = _server_fd;
-          _up = true;
-        }
+        listening = false;
       }
     }
   }
+
+  if (listening && _watchdog->open()) {
+    _up = _worker->start();
+  }
 }
 
 Server::~Server()
 {
   _up = false;
-  if (_server_fd >= 0) {
-    ::close(_server_fd);
-    _server_fd = -1;
+  for (unsigned i=0; i<_listeners.size(); i++) {
+    delete _listeners[i];
   }
-  if (_cmd) {
-    delete _cmd;
+  // the worker has to be idle before the runner goes away
+  if (_worker) {
+    _worker->stop();
+  }
+  while (!_queue.empty()) {
+    ::close(_queue.front());
+    _queue.pop_front();
   }
   if (_conns) {
-    for (unsigned i=0; i<_max_conns; i++) {
+    for (unsigned i=0; i<_nslots; i++) {
       if (_conns[i]) {
         delete _conns[i];
       }
     }
     delete[] _conns;
   }
+  if (_batch) {
+    delete _batch;
+  }
+  if (_metrics) {
+    delete _metrics;
+  }
+  if (_worker) {
+    delete _worker;
+  }
+  if (_watchdog) {
+    delete _watchdog;
+  }
+  if (_cmd) {
+    delete _cmd;
+  }
+  if (_bme) {
+    delete _bme;
+  }
   if (_pfds) {
+    if (_pfds[_signal_idx].fd >= 0) {
+      ::close(_pfds[_signal_idx].fd);
+    }
     delete[] _pfds;
   }
 }
 
-bool Server::accept()
+bool Server::accept(Listener* listener)
 {
-  struct sockaddr_in address;
-  int addrlen = sizeof(address);
-  int fd = ::accept(_server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
+  int fd = listener->accept();
 
   if (fd < 0) {
     std::perror("Error: connection accept failed");
     return false;
   } else {
+    // a connection that can't be tuned still works, so carry on regardless
+    if (listener->tcp()) _sockopts.apply(fd);
     if (_nconns < _max_conns) {
-      unsigned new_idx = _max_conns;
-      for (unsigned i=0; i<_max_conns; i++) {
+      unsigned new_idx = _nslots;
+      for (unsigned i=0; i<_nslots; i++) {
         if (_conn_pfds[i].fd < 0) {
           new_idx = i;
           break;
         }
       }
-      if (new_idx == _max_conns) {
+      if (new_idx == _nslots) {
         std::cerr << "Error: poller data structure unexpectedly full - server is fubar!!" << std::endl;
         return false;
       } else if (_conns[new_idx]) {
@@ -235,18 +496,46 @@ bool Server::accept()
       }
 
       add(new_idx, fd);
+    } else if (_queue.size() < _max_queue) {
+      // hold on to it until one of the connections goes away
+      _queue.push_back(fd);
+      _counters.queued++;
     } else {
-      ::close(fd);
+      refuse(fd);
     }
     return true;
   }
 }
 
+void Server::refuse(int fd)
+{
+  char msg[32];
+  // tell the client when to come back rather than having it reconnect straight away
+  int len = std::snprintf(msg, sizeof(msg), "BUSY %u\n", RETRY_MS);
+  if (::send(fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+    std::perror("Error: socket send failed!");
+  }
+  _counters.refused++;
+  ::close(fd);
+}
+
+void Server::admit()
+{
+  for (unsigned i=0; i<_nslots && _nconns < _max_conns && !_queue.empty(); i++) {
+    if (_conn_pfds[i].fd < 0 && !_conns[i]) {
+      add(i, _queue.front());
+      _queue.pop_front();
+    }
+  }
+}
+
 void Server::add(unsigned idx, int fd)
 {
   _conn_pfds[idx].fd = fd;
-  _conns[idx] = new Connection(fd, _cmd);
+  _conns[idx] = new Connection(idx, _gen++, fd, _cmd, _batch, &_counters, _watchdog, _idle);
   _nconns++;
+  _counters.accepted++;
+  _counters.open = _nconns;
 }
 
 void Server::remove(unsigned idx)
@@ -258,16 +547,20 @@ void Server::remove(unsigned idx)
       _conns[idx] = NULL;
     }
     _nconns--;
+    _counters.open = _nconns;
   }
 }
 
 void Server::prune()
 {
-  for (unsigned i=0; i<_max_conns; i++) {
+  for (unsigned i=0; i<_nslots; i++) {
     if (_conn_pfds[i].fd >= 0) {
       if (_conns[i]) {
         if (_conns[i]->closed()) {
           remove(i);
+        } else if (_conns[i]->idle()) {
+          _counters.evicted++;
+          remove(i);
         }
       } else {
         remove(i);
@@ -276,29 +569,156 @@ void Server::prune()
   }
 }
 
+void Server::reload()
+{
+  struct signalfd_siginfo info;
+  while (::read(_pfds[_signal_idx].fd, &info, sizeof(info)) == sizeof(info)) ;
+
+  Config config(_config);
+  if (!config.load()) {
+    std::cerr << "Error: keeping the current configuration" << std::endl;
+    return;
+  }
+  resize(config.conns);
+  _worker->configure(config);
+  _config = config;
+}
+
+void Server::resize(const unsigned max_conns)
+{
+  // the table only ever grows, so the ids of the open connections hold
+  if (max_conns > _nslots) {
+    Connection** conns = new Connection*[max_conns];
+    pollfd* pfds = new pollfd[max_conns + _conn_idx];
+    for (unsigned i=0; i<_nfds; i++) {
+      pfds[i] = _pfds[i];
+    }
+    for (unsigned n=0; n<max_conns; n++) {
+      conns[n] = n < _nslots ? _conns[n] : NULL;
+    }
+    for (unsigned i=_nfds; i<max_conns + _conn_idx; i++) {
+      pfds[i].fd       = -1;
+      pfds[i].events   = POLLIN;
+      pfds[i].revents  = 0;
+    }
+    delete[] _conns;
+    delete[] _pfds;
+    _conns = conns;
+    _pfds = pfds;
+    _conn_pfds = _pfds + _conn_idx;
+    _nslots = max_conns;
+    _nfds = max_conns + _conn_idx;
+  }
+  // a lower limit leaves the open connections alone, new clients wait in
+  // the queue until enough of them have gone
+  _max_conns = max_conns;
+}
+
+int Server::timeout() const
+{
+  int timeout = -1;
+  // wake up in time to evict the first connection to go idle
+  for (unsigned i=0; i<_nslots; i++) {
+    if (_conns[i]) {
+      int remaining = _conns[i]->idle_ms();
+      if (remaining >= 0 && (timeout < 0 || remaining < timeout)) {
+        timeout = remaining;
+      }
+    }
+  }
+  // and in time for the next health check
+  int check = _watchdog->timeout();
+  if (check >= 0 && (timeout < 0 || check < timeout)) {
+    timeout = check;
+  }
+  return timeout;
+}
+
+void Server::dispatch(Request* req)
+{
+  // hand the reply to everyone that asked the same question
+  for (unsigned i=0; i<req->followers.size(); i++) {
+    req->followers[i]->reply = req->reply;
+    deliver(req->followers[i]);
+  }
+  req->followers.clear();
+  deliver(req);
+}
+
+void Server::deliver(Request* req)
+{
+  // the connection may have gone away while the worker was busy
+  if (req->conn < _nslots && _conns[req->conn] && _conns[req->conn]->matches(req)) {
+    if (!_conns[req->conn]->complete(req)) remove(req->conn);
+  } else {
+    delete req;
+  }
+}
+
 void Server::run()
 {
   while(_up) {
-    // prune dead connections
+    // prune dead and idle connections
     prune();
 
-    int npoll = ::poll(_pfds, (nfds_t) _nfds, _sim ? 500 : -1);
+    // let in the clients waiting for a free connection
+    admit();
+
+    // stop reading from connections with too many replies outstanding
+    for (unsigned i=0; i<_nslots; i++) {
+      if (_conns[i]) {
+        _conn_pfds[i].events = _conns[i]->busy() ? 0 : POLLIN;
+      }
+    }
+
+    int npoll = ::poll(_pfds, (nfds_t) _nfds, timeout());
     if (npoll < 0) {
       _up = false;
       std::perror("Error: server poller failed");
     } else {
-      for (unsigned i=0; i<_max_conns; i++) {
+      _watchdog->loop().begin("poll handlers");
+      for (unsigned i=0; i<_nslots; i++) {
         if (_conn_pfds[i].revents & POLLIN) {
           if (!_conns[i]->process()) remove(i);
         }
       }
 
-      if (_pfds[_server_idx].revents & POLLIN) {
-        _up = accept();
+      // run everything read on this pass, sharing identical queries
+      Request* req;
+      _batch->submit();
+      while ((req = _batch->rejected()) != NULL) {
+        dispatch(req);
       }
+
+      if (_pfds[_worker_idx].revents & POLLIN) {
+        _worker->clear();
+        while ((req = _worker->complete()) != NULL) {
+          dispatch(req);
+        }
+      }
+
+      for (unsigned i=0; i<_nlisteners; i++) {
+        if ((_pfds[i].revents & POLLIN) && !accept(_listeners[i])) {
+          _up = false;
+        }
+      }
+
+      if (_sim) _sim->process(_pfds + _sim_idx);
+
+      if (_metrics) _metrics->process(_pfds + _metrics_idx);
+
+      if (_bme && (_pfds[_bme_idx].revents & (POLLIN | POLLHUP | POLLERR))) {
+        if (!_bme->process()) _pfds[_bme_idx].fd = -1;
+      }
+
+      if (_pfds[_signal_idx].revents & POLLIN) reload();
+      _watchdog->loop().end();
     }
 
-    if(_sim) _sim->checkBME();
+    // stop petting the hardware watchdog while the worker is stuck
+    _watchdog->check();
+
+    if(_sim) _sim->tick();
   }
 }
 
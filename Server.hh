@@ -1,68 +1,152 @@
 #ifndef Pds_Jungfrau_Server_hh
 #define Pds_Jungfrau_Server_hh
 
+#include "Config.hh"
+#include "Metrics.hh"
+#include "Timer.hh"
+#include "Watchdog.hh"
+
 #include <poll.h>
+#include <deque>
 #include <string>
+#include <vector>
 
 namespace Pds {
   namespace Jungfrau {
+    class Backend;
     class Simulator;
-    class CommandRunner;
+    class BmeControl;
+    class Runner;
+    class Request;
+    class Worker;
+    class Batch;
+    class Listener;
+
+    /*
+     * Options set on every accepted control connection.
+     */
+    struct SocketOptions {
+      SocketOptions();
+      bool apply(int fd) const;
+      bool     nodelay;
+      unsigned keepidle;
+      unsigned keepintvl;
+      unsigned keepcnt;
+      unsigned bufsize;
+    };
 
     class Connection {
     public:
-      Connection(int fd, CommandRunner* cmd, const unsigned bufsz=1024);
+      enum { BUFSZ = 1024, MAX_PENDING = 32 };
+      Connection(unsigned id, unsigned long gen, int fd,
+                 Runner* cmd, Batch* batch, Counters* counters,
+                 const Watchdog* watchdog, const unsigned long idle=0,
+                 const unsigned bufsz=BUFSZ);
       ~Connection();
       void shutdown();
       bool closed() const;
+      bool busy() const;
+      bool idle() const;
+      int idle_ms() const;
+      bool matches(const Request* req) const;
       bool process();
+      bool complete(Request* req);
 
     private:
       std::string buffer_to_str(char* buffer) const;
+      std::string tagged(const Request* req) const;
       bool reply(std::string cmd);
+      bool flush();
       bool parse();
 
     private:
-      const unsigned _bufsz;
-      bool           _overflow;
-      int            _fd;
-      char*          _wpos;
-      char*          _buf;
-      CommandRunner* _cmd;
+      const unsigned      _id;
+      const unsigned long _gen;
+      const unsigned long _idle;
+      const unsigned      _bufsz;
+      bool                _overflow;
+      int                 _fd;
+      char*               _wpos;
+      char*               _buf;
+      Runner*             _cmd;
+      Batch*              _batch;
+      Counters*           _counters;
+      const Watchdog*     _watchdog;
+      unsigned            _inflight;
+      Deadline            _expiry;
+      std::deque<Request*> _pending;
     };
 
     class Server {
     public:
-      Server(std::string name,
-             std::string path,
+      enum { RETRY_MS = 1000 };
+      Server(const Config& config,
+             Backend* backend,
              std::string block,
-             const unsigned port,
-             const unsigned max_conns,
+             const std::vector<std::string>& listen,
              Simulator* sim = NULL,
-             const unsigned num_ps=1,
-             const unsigned num_gpios=1,
-             const unsigned num_gfm=0,
-             const unsigned num_fan=0);
+             std::string bme="",
+             const unsigned verify=1000,
+             const unsigned metrics=0,
+             const unsigned queue=2,
+             const unsigned idle=0,
+             const SocketOptions& sockopts=SocketOptions(),
+             const WatchdogOptions& watchdog=WatchdogOptions());
+      Server(Runner* runner,
+             const Config& config,
+             const std::vector<std::string>& listen,
+             const unsigned verify=0,
+             const unsigned metrics=0,
+             const unsigned queue=2,
+             const unsigned idle=0,
+             const SocketOptions& sockopts=SocketOptions(),
+             const WatchdogOptions& watchdog=WatchdogOptions());
       ~Server();
       void run();
 
     private:
+      void setup(const std::vector<std::string>& listen, const unsigned metrics);
       void add(unsigned idx, int fd);
       void remove(unsigned idx);
       void prune();
-      bool accept();
+      void reload();
+      void resize(const unsigned max_conns);
+      void admit();
+      void refuse(int fd);
+      int timeout() const;
+      void deliver(Request* req);
+      void dispatch(Request* req);
+      bool accept(Listener* listener);
 
     private:
-      const unsigned _max_conns;
-      const unsigned _server_idx;
+      unsigned       _max_conns;
+      unsigned       _nslots;
+      const unsigned _max_queue;
+      const unsigned long _idle;
+      const SocketOptions _sockopts;
+      const unsigned _nlisteners;
+      const unsigned _sim_idx;
+      const unsigned _bme_idx;
+      const unsigned _worker_idx;
+      const unsigned _signal_idx;
+      const unsigned _metrics_idx;
       const unsigned _conn_idx;
       bool           _up;
       nfds_t         _nfds;
       unsigned       _nconns;
-      int            _server_fd;
+      unsigned long  _gen;
       Simulator*     _sim;
-      CommandRunner* _cmd;
+      BmeControl*    _bme;
+      Runner*        _cmd;
+      Watchdog*      _watchdog;
+      Worker*        _worker;
+      Batch*         _batch;
+      Metrics*       _metrics;
+      Counters       _counters;
+      Config         _config;
+      std::vector<Listener*> _listeners;
       Connection**   _conns;
+      std::deque<int> _queue;
       pollfd*        _pfds;
       pollfd*        _conn_pfds;
     };
@@ -1,31 +1,231 @@
 #include "Simulator.hh"
 #include "Reader.hh"
+#include "Backend.hh"
+#include "Timer.hh"
 
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <termios.h>
 #include <stdlib.h>
 
 using namespace Pds::Jungfrau;
 
+// fraction of the nominal output voltage where the dc warning clears
+const double SupplyModel::DC_THRESHOLD = 0.9;
+// supply temperature (in mC) that raises the temperature warning
+const int SupplyModel::TEMP_THRESHOLD = 60000;
+// steady state temperature rise (in mC) per mA of load
+const int SupplyModel::TEMP_PER_CURRENT = 5;
+// extra temperature rise (in mC) of an overheating supply
+const int SupplyModel::OVER_TEMP_RISE = 45000;
+// extra current, as a multiple of the module current, drawn by a module as it is enabled
+const double SupplyModel::INRUSH_PEAK = 2.0;
+// time constant (in s) of the decay of the module inrush current
+const double SupplyModel::TAU_INRUSH = 0.02;
+
+SupplyModel::SupplyModel(double tau_on,
+                         double tau_off,
+                         double tau_temp,
+                         int voltage,
+                         int idle_current,
+                         int module_current,
+                         int ambient) :
+  _tau_on(tau_on),
+  _tau_off(tau_off),
+  _tau_temp(tau_temp),
+  _voltage(voltage),
+  _idle_current(idle_current),
+  _module_current(module_current),
+  _ambient(ambient),
+  _on(false),
+  _fault(0),
+  _target(0.0),
+  _start(Deadline::now()),
+  _start_level(0.0),
+  _nmodules(0),
+  _temp(ambient),
+  _temp_time(_start),
+  _inrush(0.0),
+  _inrush_time(_start)
+{}
+
+SupplyModel::~SupplyModel()
+{}
+
+void SupplyModel::set_power(bool on)
+{
+  _on = on;
+  retarget();
+}
+
+bool SupplyModel::get_power() const
+{
+  return _on;
+}
+
+void SupplyModel::set_fault(unsigned fault)
+{
+  _fault = fault;
+  retarget();
+}
+
+unsigned SupplyModel::get_fault() const
+{
+  return _fault;
+}
+
+void SupplyModel::update(unsigned nmodules)
+{
+  // integrate the first order thermal response since the last update
+  double t = Deadline::now();
+  _temp += (temp_target() - _temp) * (1.0 - std::exp(-(t - _temp_time) / _tau_temp));
+  _temp_time = t;
+  // each newly enabled module adds a decaying inrush on top of its load
+  if (nmodules > _nmodules) {
+    _inrush = inrush() + (nmodules - _nmodules) * _module_current * INRUSH_PEAK;
+    _inrush_time = t;
+  }
+  _nmodules = nmodules;
+}
+
+bool SupplyModel::ramping() const
+{
+  return std::fabs(level() - _target) >= 1e-3 || inrush() >= 1.0;
+}
+
+bool SupplyModel::settled() const
+{
+  return !ramping() && std::fabs(temp_target() - _temp) < 10.0;
+}
+
+int SupplyModel::get_voltage() const
+{
+  return (int) (_voltage * level());
+}
+
+int SupplyModel::get_current(unsigned nmodules) const
+{
+  return (int) ((_idle_current + _module_current * nmodules + inrush()) * level());
+}
+
+int SupplyModel::get_temp() const
+{
+  return (int) _temp;
+}
+
+int SupplyModel::get_dc_warning() const
+{
+  return level() < DC_THRESHOLD ? 1 : 0;
+}
+
+int SupplyModel::get_ac_warning() const
+{
+  return (_fault & AC_FAIL) ? 1 : 0;
+}
+
+int SupplyModel::get_temp_warning() const
+{
+  return _temp > TEMP_THRESHOLD ? 1 : 0;
+}
+
+double SupplyModel::level() const
+{
+  // first order response towards fully on or fully off
+  double tau = _target > 0.0 ? _tau_on : _tau_off;
+  return _target + (_start_level - _target) * std::exp(-(Deadline::now() - _start) / tau);
+}
+
+double SupplyModel::inrush() const
+{
+  return _inrush * std::exp(-(Deadline::now() - _inrush_time) / TAU_INRUSH);
+}
+
+double SupplyModel::target() const
+{
+  if (_fault & AC_FAIL) {
+    return 0.0;
+  } else if (_on) {
+    return (_fault & NO_RAMP) ? 0.0 : 1.0;
+  } else {
+    return (_fault & STUCK_ON) ? 1.0 : 0.0;
+  }
+}
+
+double SupplyModel::temp_target() const
+{
+  double rise = TEMP_PER_CURRENT * get_current(_nmodules);
+  if (_fault & OVER_TEMP) rise += OVER_TEMP_RISE;
+  return _ambient + rise;
+}
+
+void SupplyModel::retarget()
+{
+  double next = target();
+  if (next != _target) {
+    // start the new ramp from wherever the output is right now
+    _start_level = level();
+    _start = Deadline::now();
+    _target = next;
+  }
+}
+
+// minimum time (in s) between updates of the simulated supplies
+const double Simulator::TICK = 0.01;
+// time (in s) between updates when only the temperatures are moving
+const double Simulator::THERMAL_TICK = 1.0;
+
+const char* const Simulator::BME_NAMES[] = {
+  "BME_temperature",
+  "BME_humidity",
+  "BME_pressure",
+  "BME_altitude",
+};
+
+const char* const Simulator::BME_FORMATS[] = {
+  "Temperature = %f *C\r\n",
+  "Humidity = %f %%\r\n",
+  "Pressure = %f hPa\r\n",
+  "Approx. Altitude = %f m\r\n",
+};
 
 Simulator::Simulator(std::string path) :
-  _bmefd(-1)
+  _path(path),
+  _bmefd(-1),
+  _watchfd(-1),
+  _logwd(-1),
+  _num_ps(0),
+  _num_gpios(0),
+  _dirty(false),
+  _last(0.0),
+  _next(-1.0),
+  _dropped(0),
+  _devices(NULL),
+  _memory(NULL),
+  _supply(NULL),
+  _readback(NULL)
 {
   // Setup the BME.
 #ifdef _GNU_SOURCE
   //_bmefd = ::getpt();
-  _bmefd = posix_openpt(O_RDWR | O_NOCTTY);
+  _bmefd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
   grantpt(_bmefd);
   unlockpt(_bmefd);
   {
       struct termios t;
       char buf[1024];
       tcgetattr(_bmefd, &t);
-      t.c_lflag |= ~ECHO;
+      t.c_lflag &= ~ECHO;
       tcsetattr(_bmefd, TCSANOW, &t);
       if (!ptsname_r(_bmefd, buf, sizeof(buf))) {
           ::unlink(File(path, "BME").filename().c_str());
@@ -33,18 +233,105 @@ Simulator::Simulator(std::string path) :
       }
   }
 #endif
-  _bme_temp = File(path, "BME_temperature").filename();
-  _bme_humid = File(path, "BME_humidity").filename();
-  _bme_press = File(path, "BME_pressure").filename();
-  _bme_alt = File(path, "BME_altitude").filename();
+  // nominal readings until something else is dropped in
+  _bme[BME_TEMP] = 22.5;
+  _bme[BME_HUMID] = 40.0;
+  _bme[BME_PRESS] = 1013.25;
+  _bme[BME_ALT] = 0.0;
+  for (unsigned i=0; i<BME_NUM; i++) {
+    _bme_file[i] = File(path, BME_NAMES[i]).filename();
+  }
+
+  // watch for new values being dropped into the sim directory
+  _watchfd = inotify_init1(IN_NONBLOCK);
+  if (_watchfd < 0) {
+    std::perror("Error: inotify_init failed for simulator");
+  } else {
+    _logwd = inotify_add_watch(_watchfd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (_logwd < 0) {
+      std::perror("Error: inotify_add_watch failed for simulator");
+    }
+  }
+
+  // pick up anything that was there before we started
+  checkBME();
+
+  _ticker.open();
 }
 
 Simulator::~Simulator()
 {
+  if (_dropped) {
+    std::cerr << "Dropped " << _dropped << " simulated BME frames that were never read" << std::endl;
+  }
   if (_bmefd >= 0) {
     ::close(_bmefd);
     _bmefd = -1;
   }
+  if (_watchfd >= 0) {
+    ::close(_watchfd);
+    _watchfd = -1;
+  }
+  if (_supply) {
+    for (unsigned i=0; i<_num_ps; i++) {
+      if (_supply[i]) {
+        delete _supply[i];
+      }
+    }
+    delete[] _supply;
+  }
+  if (_readback) {
+    delete[] _readback;
+  }
+  if (_devices) {
+    delete _devices;
+  }
+}
+
+void Simulator::drive(std::string devpath,
+                      const unsigned num_ps,
+                      const unsigned num_gpios,
+                      double tau_on,
+                      double tau_off)
+{
+  _devpath = devpath;
+  _num_ps = num_ps;
+  _num_gpios = num_gpios;
+  _dirty = true;
+  _devices = new SysfsBackend(devpath);
+  _supply = num_ps > 0 ? new SupplyModel*[num_ps] : NULL;
+  _readback = num_ps > 0 ? new Readback[num_ps] : NULL;
+  for (unsigned i=0; i<num_ps; i++) {
+    _supply[i] = new SupplyModel(tau_on, tau_off);
+    // force the first tick to write out every value
+    std::memset(&_readback[i], 0xff, sizeof(Readback));
+    watch(key("hwmon/ps", i, ""));
+  }
+  for (unsigned j=0; j<num_gpios; j++) {
+    watch(key("gpios/", j, ""));
+  }
+  checkFaults();
+}
+
+void Simulator::attach(MemoryBackend* backend, const unsigned num_ps)
+{
+  // the memory backend updates its own supplies so only faults are needed
+  _num_ps = num_ps;
+  _memory = backend;
+  checkFaults();
+}
+
+bool Simulator::stream(double rate)
+{
+  if (rate <= 0.0 || !_stream.open()) {
+    return false;
+  }
+
+  unsigned long period = (unsigned long) (1e6 / rate);
+  if (period == 0) {
+    period = 1;
+  }
+  return _stream.arm(Deadline(period), period);
 }
 
 double Simulator::readFloat(std::string filename) const
@@ -62,28 +349,242 @@ double Simulator::readFloat(std::string filename) const
 void Simulator::writeBME(std::string format, double value) const
 {
     char buf[1024];
-    ::sprintf(buf, format.c_str(), value);
-    write(_bmefd, buf, strlen(buf));
+    ::snprintf(buf, sizeof(buf), format.c_str(), value);
+    ::write(_bmefd, buf, strlen(buf));
 }
 
-void Simulator::checkBME() const
+void Simulator::checkBME()
 {
     struct stat buf;
-    double v;
-    if (stat(_bme_temp.c_str(), &buf) == 0) {
-        v = readFloat(_bme_temp);
-        writeBME("Temperature = %f *C\r\n", v);
+    for (unsigned i=0; i<BME_NUM; i++) {
+        if (stat(_bme_file[i].c_str(), &buf) == 0) {
+            emitBME(i);
+        }
+    }
+}
+
+void Simulator::checkFaults()
+{
+  struct stat buf;
+  for (unsigned i=0; i<_num_ps; i++) {
+    std::stringstream name;
+    name << "fault_ps" << i;
+    std::string fault = File(_path, name.str()).filename();
+    if (stat(fault.c_str(), &buf) == 0) {
+      this->fault(i, (unsigned) readFloat(fault));
+    }
+  }
+}
+
+void Simulator::setup(pollfd* pfds) const
+{
+  pfds[0].fd = _watchfd;
+  pfds[1].fd = _bmefd;
+  pfds[2].fd = _stream.fd();
+  pfds[3].fd = _ticker.fd();
+  for (unsigned i=0; i<NFDS; i++) {
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+}
+
+void Simulator::process(const pollfd* pfds)
+{
+  if (pfds[0].revents & POLLIN) {
+    drain();
+  }
+  if (pfds[1].revents & POLLIN) {
+    // throw away whatever the consumer sends to the sensor
+    char buf[256];
+    while (::read(_bmefd, buf, sizeof(buf)) > 0) ;
+  }
+  if ((pfds[2].revents & POLLIN) && _stream.expired()) {
+    streamBME();
+  }
+  if (pfds[3].revents & POLLIN) {
+    // the supplies are brought up to date by the tick that follows
+    _ticker.expired();
+  }
+}
+
+void Simulator::tick()
+{
+  // catch writes made while the server wasn't polling
+  drain();
+
+  double now = Deadline::now();
+  double wait = period();
+  if (wait >= 0.0 && (now - _last >= wait)) {
+    _last = now;
+    _dirty = false;
+    for (unsigned i=0; i<_num_ps; i++) {
+      update(i);
+    }
+    wait = period();
+  }
+
+  // wake the server up exactly when the next update is due
+  double next = wait >= 0.0 ? _last + wait : -1.0;
+  if (next != _next) {
+    _next = next;
+    if (next < 0.0) {
+      _ticker.disarm();
+    } else {
+      double delay = next - Deadline::now();
+      _ticker.arm(Deadline(delay > 0.0 ? (unsigned long) (delay * 1e6) : 0));
+    }
+  }
+}
+
+void Simulator::fault(unsigned id, unsigned mask)
+{
+  if (_memory) {
+    _memory->set_fault(id, mask);
+  } else {
+    _supply[id]->set_fault(mask);
+    _dirty = true;
+  }
+}
+
+void Simulator::watch(std::string dir)
+{
+  if (_watchfd >= 0) {
+    std::string path = _devpath + "/" + dir;
+    if (inotify_add_watch(_watchfd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      std::cerr << "Error: inotify_add_watch failed for " << path << ": "
+                << std::strerror(errno) << std::endl;
+    }
+  }
+}
+
+void Simulator::drain()
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  if (_watchfd < 0) return;
+
+  while ((len = ::read(_watchfd, buf, sizeof(buf))) > 0) {
+    for (char* ptr = buf; ptr < buf + len; ) {
+      const struct inotify_event* ev = (const struct inotify_event*) ptr;
+      if (ev->len > 0) {
+        event(ev->wd, ev->name);
+      }
+      ptr += sizeof(struct inotify_event) + ev->len;
     }
-    if (stat(_bme_humid.c_str(), &buf) == 0) {
-        v = readFloat(_bme_humid);
-        writeBME("Humidity = %f \%\r\n", v);
+  }
+}
+
+void Simulator::event(int wd, const char* name)
+{
+  if (wd == _logwd) {
+    unsigned id;
+    for (unsigned i=0; i<BME_NUM; i++) {
+      if (!strcmp(name, BME_NAMES[i])) {
+        emitBME(i);
+        return;
+      }
+    }
+    if (sscanf(name, "fault_ps%u", &id) == 1 && id < _num_ps) {
+      fault(id, (unsigned) readFloat(File(_path, name).filename()));
+    }
+  } else if (!strncmp(name, "set_", 4)) {
+    // something switched a supply or a module
+    _dirty = true;
+  }
+}
+
+void Simulator::emitBME(unsigned idx)
+{
+  _bme[idx] = readFloat(_bme_file[idx]);
+  writeBME(BME_FORMATS[idx], _bme[idx]);
+}
+
+void Simulator::streamBME()
+{
+  // wander a little around the last values dropped in
+  double now = Deadline::now();
+  for (unsigned i=0; i<BME_NUM; i++) {
+    char buf[1024];
+    double value = _bme[i] * (1.0 + 0.001 * std::sin(now + i));
+    ::snprintf(buf, sizeof(buf), BME_FORMATS[i], value);
+    if (::write(_bmefd, buf, strlen(buf)) < 0) {
+      // nobody is reading the port so drop the frames
+      if (!_dropped++) {
+        std::cerr << "Warning: nobody is reading the simulated BME port, dropping frames" << std::endl;
+      }
+      return;
+    }
+  }
+  if (_dropped) {
+    std::cerr << "Dropped " << _dropped << " simulated BME frames before the port was read again" << std::endl;
+    _dropped = 0;
+  }
+}
+
+double Simulator::period() const
+{
+  double wait = -1.0;
+  if (_devices) {
+    // tick quickly while any of the supplies are still ramping
+    if (_dirty) return TICK;
+    for (unsigned i=0; i<_num_ps; i++) {
+      if (_supply[i]->ramping()) {
+        return TICK;
+      } else if (!_supply[i]->settled()) {
+        wait = THERMAL_TICK;
+      }
     }
-    if (stat(_bme_press.c_str(), &buf) == 0) {
-        v = readFloat(_bme_press);
-        writeBME("Pressure = %f hPa\r\n", v);
+  }
+  return wait;
+}
+
+void Simulator::update(unsigned id)
+{
+  Readback& rb = _readback[id];
+  SupplyModel* supply = _supply[id];
+  unsigned nmodules = 0;
+  bool power = _devices->read_value(key("hwmon/ps", id, "set_power")) > 0;
+
+  if (id < _num_gpios) {
+    // the supply output can be switched from either the hwmon or the gpio
+    if (_devices->read_value(key("gpios/", id, "set_power_supply_onoff")) > 0)
+      power = true;
+    for (int num=1; num<=GpioControl::NUM_MCB; num++) {
+      std::stringstream cmd;
+      cmd << "set_mcb" << num;
+      if (_devices->read_value(key("gpios/", id, cmd.str())) > 0)
+        nmodules++;
     }
-    if (stat(_bme_alt.c_str(), &buf) == 0) {
-        v = readFloat(_bme_alt);
-        writeBME("Approx. Altitude = %f m\r\n", v);
+  }
+
+  supply->set_power(power);
+  supply->update(nmodules);
+
+  write(key("hwmon/ps", id, "volt_input"), supply->get_voltage(), rb.volt);
+  write(key("hwmon/ps", id, "curr_input"), supply->get_current(nmodules), rb.curr);
+  write(key("hwmon/ps", id, "temp_input"), supply->get_temp(), rb.temp);
+  if (id < _num_gpios) {
+    write(key("gpios/", id, "get_dc_warning"), supply->get_dc_warning(), rb.dc);
+    write(key("gpios/", id, "get_ac_warning"), supply->get_ac_warning(), rb.ac);
+    write(key("gpios/", id, "get_temp_warning"), supply->get_temp_warning(), rb.warn);
+  }
+}
+
+void Simulator::write(const std::string& key, int value, int& last)
+{
+  if (value != last) {
+    if (_devices->write_value(value, key)) {
+      last = value;
     }
+  }
+}
+
+std::string Simulator::key(std::string dev, int id, std::string cmd)
+{
+  std::stringstream key;
+  key << dev;
+  if (id >= 0) key << id;
+  key << '/' << cmd;
+  return key.str();
 }
@@ -1,25 +1,145 @@
 #ifndef Pds_Jungfrau_Simulator_hh
 #define Pds_Jungfrau_Simulator_hh
 
+#include "Timer.hh"
+
+#include <poll.h>
 #include <string>
 
 namespace Pds {
   namespace Jungfrau {
+    class Backend;
+    class MemoryBackend;
+
+    class SupplyModel {
+    public:
+      enum Fault { NO_RAMP=1, STUCK_ON=2, OVER_TEMP=4, AC_FAIL=8 };
+      SupplyModel(double tau_on=0.1,
+                  double tau_off=0.5,
+                  double tau_temp=30.0,
+                  int voltage=11980,
+                  int idle_current=156,
+                  int module_current=150,
+                  int ambient=22600);
+      ~SupplyModel();
+
+      void set_power(bool on);
+      bool get_power() const;
+      void set_fault(unsigned fault);
+      unsigned get_fault() const;
+      void update(unsigned nmodules);
+      bool ramping() const;
+      bool settled() const;
+      int get_voltage() const;
+      int get_current(unsigned nmodules) const;
+      int get_temp() const;
+      int get_dc_warning() const;
+      int get_ac_warning() const;
+      int get_temp_warning() const;
+
+      static const double DC_THRESHOLD;
+      static const int    TEMP_THRESHOLD;
+      static const int    TEMP_PER_CURRENT;
+      static const int    OVER_TEMP_RISE;
+      static const double INRUSH_PEAK;
+      static const double TAU_INRUSH;
+
+    private:
+      double level() const;
+      double inrush() const;
+      double target() const;
+      double temp_target() const;
+      void retarget();
+
+    private:
+      const double _tau_on;
+      const double _tau_off;
+      const double _tau_temp;
+      const int    _voltage;
+      const int    _idle_current;
+      const int    _module_current;
+      const int    _ambient;
+      bool         _on;
+      unsigned     _fault;
+      double       _target;
+      double       _start;
+      double       _start_level;
+      unsigned     _nmodules;
+      double       _temp;
+      double       _temp_time;
+      double       _inrush;
+      double       _inrush_time;
+    };
+
     class Simulator {
     public:
       Simulator(std::string path);
       virtual ~Simulator();
 
+      void drive(std::string devpath,
+                 const unsigned num_ps,
+                 const unsigned num_gpios,
+                 double tau_on,
+                 double tau_off);
+      void attach(MemoryBackend* backend, const unsigned num_ps);
+      bool stream(double rate);
       double readFloat(std::string filename) const;
       void writeBME(std::string format, double value) const;
-      void checkBME() const;
+      void checkBME();
+      void checkFaults();
+      void setup(pollfd* pfds) const;
+      void process(const pollfd* pfds);
+      void tick();
+
+      static const double TICK;
+      static const double THERMAL_TICK;
+      static const unsigned NFDS = 4;
+
+    private:
+      enum BmeValue { BME_TEMP, BME_HUMID, BME_PRESS, BME_ALT, BME_NUM };
+      struct Readback {
+        int volt;
+        int curr;
+        int temp;
+        int dc;
+        int ac;
+        int warn;
+      };
+
+      void fault(unsigned id, unsigned mask);
+      void watch(std::string dir);
+      void drain();
+      void event(int wd, const char* name);
+      void emitBME(unsigned idx);
+      void streamBME();
+      double period() const;
+      void update(unsigned id);
+      void write(const std::string& key, int value, int& last);
+      static std::string key(std::string dev, int id, std::string cmd);
+
+      static const char* const BME_NAMES[];
+      static const char* const BME_FORMATS[];
 
     private:
+      std::string    _path;
+      std::string    _devpath;
       int            _bmefd;
-      std::string    _bme_temp;
-      std::string    _bme_humid;
-      std::string    _bme_press;
-      std::string    _bme_alt;
+      int            _watchfd;
+      int            _logwd;
+      unsigned       _num_ps;
+      unsigned       _num_gpios;
+      bool           _dirty;
+      double         _last;
+      double         _next;
+      Timer          _stream;
+      Timer          _ticker;
+      unsigned long  _dropped;
+      Backend*       _devices;
+      MemoryBackend* _memory;
+      SupplyModel**  _supply;
+      Readback*      _readback;
+      std::string    _bme_file[BME_NUM];
+      double         _bme[BME_NUM];
     };
   }
 }
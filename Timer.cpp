@@ -0,0 +1,123 @@
+#include "Timer.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+using namespace Pds::Jungfrau;
+
+Deadline::Deadline(unsigned long usec)
+{
+  clock_gettime(CLOCK_MONOTONIC, &_when);
+  extend(usec);
+}
+
+Deadline::~Deadline()
+{}
+
+void Deadline::extend(unsigned long usec)
+{
+  _when.tv_sec += usec / 1000000;
+  _when.tv_nsec += (usec % 1000000) * 1000;
+  if (_when.tv_nsec >= 1000000000) {
+    _when.tv_sec++;
+    _when.tv_nsec -= 1000000000;
+  }
+}
+
+bool Deadline::expired() const
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec > _when.tv_sec ||
+    (ts.tv_sec == _when.tv_sec && ts.tv_nsec >= _when.tv_nsec);
+}
+
+int Deadline::remaining_ms() const
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  long long nsec = (long long) (_when.tv_sec - ts.tv_sec) * 1000000000LL +
+    (_when.tv_nsec - ts.tv_nsec);
+  // round up so a poll never wakes just before the deadline
+  return nsec > 0 ? (int) ((nsec + 999999) / 1000000) : 0;
+}
+
+void Deadline::sleep() const
+{
+  // an absolute wake up doesn't drift when a sleep is interrupted
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &_when, NULL) == EINTR) ;
+}
+
+const struct timespec& Deadline::when() const
+{
+  return _when;
+}
+
+double Deadline::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+Timer::Timer() :
+  _fd(-1)
+{}
+
+Timer::~Timer()
+{
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+}
+
+bool Timer::open()
+{
+  _fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (_fd < 0) {
+    std::perror("Error: timerfd_create failed");
+    return false;
+  }
+  return true;
+}
+
+int Timer::fd() const
+{
+  return _fd;
+}
+
+bool Timer::arm(const Deadline& deadline, unsigned long period)
+{
+  struct itimerspec its;
+  its.it_value = deadline.when();
+  its.it_interval.tv_sec = period / 1000000;
+  its.it_interval.tv_nsec = (period % 1000000) * 1000;
+  // a zero value would disarm the timer rather than fire it straight away
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+    its.it_value.tv_nsec = 1;
+  }
+  if (timerfd_settime(_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+    std::perror("Error: timerfd_settime failed");
+    return false;
+  }
+  return true;
+}
+
+bool Timer::disarm()
+{
+  struct itimerspec its = {{0, 0}, {0, 0}};
+  if (timerfd_settime(_fd, 0, &its, NULL) < 0) {
+    std::perror("Error: timerfd_settime failed");
+    return false;
+  }
+  return true;
+}
+
+bool Timer::expired()
+{
+  uint64_t expirations;
+  return ::read(_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
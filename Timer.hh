@@ -0,0 +1,47 @@
+#ifndef Pds_Jungfrau_Timer_hh
+#define Pds_Jungfrau_Timer_hh
+
+#include <time.h>
+
+namespace Pds {
+  namespace Jungfrau {
+    /*
+     * A point in time on the monotonic clock, so waits are not thrown
+     * off when the wall clock is stepped.
+     */
+    class Deadline {
+    public:
+      Deadline(unsigned long usec=0);
+      ~Deadline();
+      void extend(unsigned long usec);
+      bool expired() const;
+      int remaining_ms() const;
+      void sleep() const;
+      const struct timespec& when() const;
+      static double now();
+
+    private:
+      struct timespec _when;
+    };
+
+    /*
+     * Wraps a timerfd so a deadline can sit in a poll set next to the
+     * other descriptors.
+     */
+    class Timer {
+    public:
+      Timer();
+      ~Timer();
+      bool open();
+      int fd() const;
+      bool arm(const Deadline& deadline, unsigned long period=0);
+      bool disarm();
+      bool expired();
+
+    private:
+      int _fd;
+    };
+  }
+}
+
+#endif
@@ -0,0 +1,219 @@
+#include "Watchdog.hh"
+
+#include <cstdio>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace Pds::Jungfrau;
+
+LoopStats::LoopStats(std::string name, const unsigned long threshold) :
+  _name(name),
+  _threshold(threshold),
+  _busy(false),
+  _start(0.0),
+  _beat(0.0),
+  _count(0),
+  _slow(0),
+  _total(0.0),
+  _max(0.0)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+LoopStats::~LoopStats()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+void LoopStats::begin(const std::string& what)
+{
+  pthread_mutex_lock(&_lock);
+  _busy = true;
+  _start = Deadline::now();
+  _beat = _start;
+  _what = what;
+  _step = what;
+  pthread_mutex_unlock(&_lock);
+}
+
+void LoopStats::touch(const std::string& what)
+{
+  // a long handler that is still moving along restarts the stall timer
+  pthread_mutex_lock(&_lock);
+  _beat = Deadline::now();
+  _step = what;
+  pthread_mutex_unlock(&_lock);
+}
+
+void LoopStats::end()
+{
+  bool slow = false;
+  double elapsed;
+
+  pthread_mutex_lock(&_lock);
+  elapsed = (Deadline::now() - _start) * 1e6;
+  _busy = false;
+  _count++;
+  _total += elapsed;
+  if (elapsed > _max) {
+    _max = elapsed;
+    _max_what = _what;
+  }
+  if (_threshold && elapsed > _threshold) {
+    _slow++;
+    slow = true;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (slow) {
+    std::cerr << "Warning: " << _name << " spent " << (unsigned long) (elapsed / 1000)
+              << " ms on " << _what << std::endl;
+  }
+}
+
+double LoopStats::busy(std::string& what) const
+{
+  double elapsed = 0.0;
+  pthread_mutex_lock(&_lock);
+  if (_busy) {
+    elapsed = (Deadline::now() - _beat) * 1e6;
+    what = _step;
+  }
+  pthread_mutex_unlock(&_lock);
+  return elapsed;
+}
+
+void LoopStats::lag(std::string& reply) const
+{
+  char buf[64];
+  pthread_mutex_lock(&_lock);
+  std::snprintf(buf, sizeof(buf), "%lu %lu %lu",
+                (unsigned long) (_count ? _total / _count : 0.0),
+                (unsigned long) _max, _slow);
+  pthread_mutex_unlock(&_lock);
+  reply += buf;
+}
+
+void LoopStats::slowest(std::string& reply) const
+{
+  char buf[32];
+  pthread_mutex_lock(&_lock);
+  std::snprintf(buf, sizeof(buf), "%lu ", (unsigned long) _max);
+  reply += buf;
+  reply += _max_what.empty() ? std::string("NONE") : _max_what;
+  pthread_mutex_unlock(&_lock);
+}
+
+WatchdogOptions::WatchdogOptions() :
+  slow(1000),
+  stall(30000),
+  device("")
+{}
+
+Watchdog::Watchdog(const WatchdogOptions& options) :
+  _stall(options.stall * 1000UL),
+  _device(options.device),
+  _fd(-1),
+  _stuck(false),
+  _loop("event loop", options.slow * 1000UL),
+  _worker("hardware worker", options.slow * 1000UL)
+{}
+
+Watchdog::~Watchdog()
+{
+  if (_fd >= 0) {
+    // the magic close, so a clean exit doesn't end in a reset
+    if (::write(_fd, "V", 1) < 0) {
+      std::perror("Error: magic close of the hardware watchdog failed");
+    }
+    ::close(_fd);
+  }
+}
+
+bool Watchdog::open()
+{
+  if (_device.empty()) {
+    return true;
+  }
+  _fd = ::open(_device.c_str(), O_WRONLY);
+  if (_fd < 0) {
+    std::perror(("Error: failed to open the hardware watchdog " + _device).c_str());
+    return false;
+  }
+  return true;
+}
+
+LoopStats& Watchdog::loop()
+{
+  return _loop;
+}
+
+LoopStats& Watchdog::worker()
+{
+  return _worker;
+}
+
+void Watchdog::check()
+{
+  if (!_next.expired()) {
+    return;
+  }
+  _next = Deadline(CHECK_MS * 1000UL);
+
+  std::string what;
+  double busy;
+  if (healthy(what, busy)) {
+    if (_stuck) {
+      std::cerr << "The hardware worker is running again" << std::endl;
+      _stuck = false;
+    }
+    // any write keeps the hardware watchdog from firing
+    if (_fd >= 0 && ::write(_fd, "\0", 1) < 0) {
+      std::perror("Error: failed to pet the hardware watchdog");
+    }
+  } else if (!_stuck) {
+    std::cerr << "Error: the hardware worker has been stuck for "
+              << (unsigned long) (busy / 1000) << " ms on " << what << std::endl;
+    _stuck = true;
+  }
+}
+
+int Watchdog::timeout() const
+{
+  return _stall || _fd >= 0 ? _next.remaining_ms() : -1;
+}
+
+bool Watchdog::healthy(std::string& what, double& busy) const
+{
+  // the event loop can't be stuck if it got here, so only the worker can be
+  busy = _worker.busy(what);
+  return !_stall || busy <= _stall;
+}
+
+bool Watchdog::query(const std::string& cmd, std::string& reply) const
+{
+  if (!cmd.compare("HEALTH?")) {
+    std::string what;
+    double busy;
+    if (healthy(what, busy)) {
+      reply = "OK";
+    } else {
+      char buf[32];
+      std::snprintf(buf, sizeof(buf), "STALLED %lu ", (unsigned long) (busy / 1000));
+      reply = buf + what;
+    }
+  } else if (!cmd.compare("HEALTH:LAG?")) {
+    reply.clear();
+    _loop.lag(reply);
+    reply += ' ';
+    _worker.lag(reply);
+  } else if (!cmd.compare("HEALTH:SLOWEST?")) {
+    reply.clear();
+    _worker.slowest(reply);
+  } else {
+    return false;
+  }
+  reply += '\n';
+  return true;
+}
@@ -0,0 +1,84 @@
+#ifndef Pds_Jungfrau_Watchdog_hh
+#define Pds_Jungfrau_Watchdog_hh
+
+#include "Timer.hh"
+
+#include <pthread.h>
+#include <string>
+
+namespace Pds {
+  namespace Jungfrau {
+    /*
+     * How long the handlers of one loop take. The loop's own thread times
+     * them and any other thread can ask what it is stuck on.
+     */
+    class LoopStats {
+    public:
+      LoopStats(std::string name, const unsigned long threshold);
+      ~LoopStats();
+      void begin(const std::string& what);
+      void touch(const std::string& what);
+      void end();
+      double busy(std::string& what) const;
+      void lag(std::string& reply) const;
+      void slowest(std::string& reply) const;
+
+    private:
+      const std::string       _name;
+      const unsigned long     _threshold;
+      mutable pthread_mutex_t _lock;
+      bool                    _busy;
+      double                  _start;
+      double                  _beat;
+      std::string             _what;
+      std::string             _step;
+      unsigned long           _count;
+      unsigned long           _slow;
+      double                  _total;
+      double                  _max;
+      std::string             _max_what;
+    };
+
+    /*
+     * Options for the loop health checks.
+     */
+    struct WatchdogOptions {
+      WatchdogOptions();
+      unsigned    slow;
+      unsigned    stall;
+      std::string device;
+    };
+
+    /*
+     * Watches the event loop and the hardware worker for handlers that run
+     * too long, answers the HEALTH queries and only pets the hardware
+     * watchdog while neither of them is stuck.
+     */
+    class Watchdog {
+    public:
+      enum { CHECK_MS = 1000 };
+      Watchdog(const WatchdogOptions& options);
+      ~Watchdog();
+      bool open();
+      LoopStats& loop();
+      LoopStats& worker();
+      void check();
+      int timeout() const;
+      bool query(const std::string& cmd, std::string& reply) const;
+
+    private:
+      bool healthy(std::string& what, double& busy) const;
+
+    private:
+      const unsigned long _stall;
+      const std::string   _device;
+      int                 _fd;
+      bool                _stuck;
+      Deadline            _next;
+      LoopStats           _loop;
+      LoopStats           _worker;
+    };
+  }
+}
+
+#endif
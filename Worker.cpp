@@ -0,0 +1,310 @@
+#include "Worker.hh"
+#include "Reader.hh"
+#include "Timer.hh"
+#include "Watchdog.hh"
+
+#include <cstdio>
+#include <iostream>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+using namespace Pds::Jungfrau;
+
+Request::Request(unsigned conn, unsigned long gen, const std::string& cmd,
+                 const std::string& tag) :
+  conn(conn),
+  gen(gen),
+  cmd(cmd),
+  tag(tag),
+  done(false)
+{}
+
+Request::~Request()
+{}
+
+Worker::Worker(Runner* cmd, LoopStats* stats, const unsigned capacity, const unsigned verify) :
+  _cmd(cmd),
+  _stats(stats),
+  _verify(verify * 1000UL),
+  _requests(capacity),
+  _replies(capacity),
+  _outstanding(0),
+  _reconfigure(false),
+  _wakefd(-1),
+  _donefd(-1),
+  _running(false),
+  _started(false)
+{
+  pthread_mutex_init(&_config_lock, NULL);
+  // lets the long power sequences report each step they get through
+  _cmd->watch(_stats);
+  _wakefd = ::eventfd(0, 0);
+  if (_wakefd < 0) {
+    std::perror("Error: eventfd creation failed for worker requests");
+  }
+  _donefd = ::eventfd(0, EFD_NONBLOCK);
+  if (_donefd < 0) {
+    std::perror("Error: eventfd creation failed for worker replies");
+  }
+  if (_verify > 0 && !_timer.open()) {
+    std::perror("Error: timer creation failed for worker verify");
+  }
+  if (!_stepper.open()) {
+    std::perror("Error: timer creation failed for worker steps");
+  }
+}
+
+Worker::~Worker()
+{
+  stop();
+  // anything still queued is owned by us now
+  Request* req;
+  while (_requests.pop(req)) delete req;
+  while (_replies.pop(req)) delete req;
+  if (_wakefd >= 0) {
+    ::close(_wakefd);
+    _wakefd = -1;
+  }
+  if (_donefd >= 0) {
+    ::close(_donefd);
+    _donefd = -1;
+  }
+  pthread_mutex_destroy(&_config_lock);
+}
+
+bool Worker::start()
+{
+  if (_started) {
+    return true;
+  } else if (_wakefd < 0 || _donefd < 0 || _stepper.fd() < 0 ||
+             (_verify > 0 && _timer.fd() < 0)) {
+    return false;
+  }
+
+  _running = true;
+  if (pthread_create(&_thread, NULL, thread, this)) {
+    std::perror("Error: failed to start the hardware worker thread");
+    _running = false;
+    return false;
+  }
+  _started = true;
+
+  return true;
+}
+
+void Worker::stop()
+{
+  if (_started) {
+    _running = false;
+    signal(_wakefd);
+    pthread_join(_thread, NULL);
+    _started = false;
+  }
+}
+
+int Worker::fd() const
+{
+  return _donefd;
+}
+
+bool Worker::submit(Request* req)
+{
+  // never hand out more requests than the reply queue can take back
+  if (_outstanding >= _replies.capacity() || !_requests.push(req)) {
+    return false;
+  }
+  _outstanding++;
+  signal(_wakefd);
+  return true;
+}
+
+void Worker::configure(const Config& config)
+{
+  // the runner is only touched from the worker thread, so hand it over
+  pthread_mutex_lock(&_config_lock);
+  _config = config;
+  _reconfigure = true;
+  pthread_mutex_unlock(&_config_lock);
+  signal(_wakefd);
+}
+
+Request* Worker::complete()
+{
+  Request* req = NULL;
+  if (_replies.pop(req)) {
+    _outstanding--;
+    return req;
+  } else {
+    return NULL;
+  }
+}
+
+void Worker::clear()
+{
+  uint64_t count;
+  ::read(_donefd, &count, sizeof(count));
+}
+
+void* Worker::thread(void* arg)
+{
+  static_cast<Worker*>(arg)->run();
+  return NULL;
+}
+
+void Worker::run()
+{
+  if (_verify > 0) {
+    // recheck the hardware on a fixed period however busy we are
+    _timer.arm(Deadline(_verify), _verify);
+  }
+  while (_running) {
+    Request* req;
+    while (_running && _requests.pop(req)) {
+      // time every command so a stuck one can be named
+      _stats->begin(req->cmd);
+      req->reply = _cmd->run(req->cmd);
+      _stats->end();
+      // can't fail since submit bounds the outstanding requests
+      _replies.push(req);
+      signal(_donefd);
+    }
+
+    // a reloaded configuration is applied in between requests too
+    if (_reconfigure) {
+      pthread_mutex_lock(&_config_lock);
+      Config config = _config;
+      _reconfigure = false;
+      pthread_mutex_unlock(&_config_lock);
+      _stats->begin("config reload");
+      _cmd->configure(config);
+      _stats->end();
+    }
+
+    // background work like the module sequencer runs in between requests
+    _stats->begin("module sequencer");
+    long due = _cmd->step();
+    _stats->end();
+    if (due >= 0) {
+      _stepper.arm(Deadline(due));
+    } else {
+      _stepper.disarm();
+    }
+
+    // sleep until the network thread has something for us
+    if (!wait()) {
+      _running = false;
+    }
+  }
+}
+
+bool Worker::wait()
+{
+  pollfd pfds[3];
+  pfds[0].fd = _wakefd;
+  pfds[1].fd = _stepper.fd();
+  pfds[2].fd = _timer.fd();
+  for (unsigned i=0; i<3; i++) {
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+  int nready = ::poll(pfds, _verify > 0 ? 3 : 2, -1);
+  if (nready < 0) {
+    std::perror("Error: hardware worker wait failed");
+    return false;
+  }
+  if (pfds[0].revents & POLLIN) {
+    uint64_t count;
+    if (::read(_wakefd, &count, sizeof(count)) < 0) {
+      std::perror("Error: hardware worker wait failed");
+      return false;
+    }
+  }
+  if (pfds[1].revents & POLLIN) {
+    // the next step is picked up on the way round the loop
+    _stepper.expired();
+  }
+  if ((pfds[2].revents & POLLIN) && _timer.expired()) {
+    // recheck the hardware in case something else changed it
+    _stats->begin("hardware recheck");
+    _cmd->verify();
+    _stats->end();
+  }
+  return true;
+}
+
+void Worker::signal(int fd) const
+{
+  uint64_t one = 1;
+  if (::write(fd, &one, sizeof(one)) < 0) {
+    std::perror("Error: failed to signal eventfd");
+  }
+}
+
+Batch::Batch(Worker* worker) :
+  _worker(worker)
+{}
+
+Batch::~Batch()
+{
+  // the connections never see requests that didn't make it to the worker
+  for (unsigned i=0; i<_queued.size(); i++) {
+    for (unsigned j=0; j<_queued[i]->followers.size(); j++) {
+      delete _queued[i]->followers[j];
+    }
+    delete _queued[i];
+  }
+  for (unsigned i=0; i<_rejected.size(); i++) {
+    delete _rejected[i];
+  }
+}
+
+void Batch::add(Request* req)
+{
+  if (is_query(req->cmd)) {
+    LeaderMap::const_iterator it = _leaders.find(req->cmd);
+    PositionMap::const_iterator last = _last.find(req->conn);
+    // only share a reply that can't jump ahead of an earlier command
+    if (it != _leaders.end() && (last == _last.end() || last->second <= it->second)) {
+      _queued[it->second]->followers.push_back(req);
+      return;
+    }
+    _leaders[req->cmd] = _queued.size();
+  }
+  _last[req->conn] = _queued.size();
+  _queued.push_back(req);
+}
+
+void Batch::submit()
+{
+  for (unsigned i=0; i<_queued.size(); i++) {
+    if (!_worker->submit(_queued[i])) {
+      std::cerr << "Error: hardware worker queue is full - rejecting "
+                << _queued[i]->cmd << std::endl;
+      // the followers get the same reply when it is dispatched
+      _queued[i]->reply = Runner::error(Runner::ERR_BUSY);
+      _rejected.push_back(_queued[i]);
+    }
+  }
+  _queued.clear();
+  _leaders.clear();
+  _last.clear();
+}
+
+Request* Batch::rejected()
+{
+  if (_rejected.empty()) {
+    return NULL;
+  } else {
+    Request* req = _rejected.back();
+    _rejected.pop_back();
+    return req;
+  }
+}
+
+bool Batch::is_query(const std::string& cmd)
+{
+  // getters never change anything so one run can answer all of them
+  return !cmd.empty() && cmd[cmd.length() - 1] == '?' && cmd.find(' ') == std::string::npos;
+}
@@ -0,0 +1,99 @@
+#ifndef Pds_Jungfrau_Worker_hh
+#define Pds_Jungfrau_Worker_hh
+
+#include "Config.hh"
+#include "Queue.hh"
+#include "Timer.hh"
+
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Pds {
+  namespace Jungfrau {
+    class Runner;
+    class LoopStats;
+
+    class Request {
+    public:
+      Request(unsigned conn, unsigned long gen, const std::string& cmd,
+              const std::string& tag="");
+      ~Request();
+
+      const unsigned      conn;
+      const unsigned long gen;
+      const std::string   cmd;
+      // the id of a tagged request, echoed back in front of the reply
+      const std::string   tag;
+      std::string         reply;
+      bool                done;
+      // requests from other connections waiting on the same reply
+      std::vector<Request*> followers;
+    };
+
+    class Worker {
+    public:
+      Worker(Runner* cmd, LoopStats* stats, const unsigned capacity, const unsigned verify=0);
+      ~Worker();
+      bool start();
+      void stop();
+      int fd() const;
+      bool submit(Request* req);
+      void configure(const Config& config);
+      Request* complete();
+      void clear();
+
+    private:
+      static void* thread(void* arg);
+      void run();
+      bool wait();
+      void signal(int fd) const;
+
+    private:
+      Runner*             _cmd;
+      LoopStats*          _stats;
+      const unsigned long _verify;
+      Timer               _timer;
+      Timer               _stepper;
+      Queue<Request*>     _requests;
+      Queue<Request*>     _replies;
+      unsigned            _outstanding;
+      pthread_mutex_t     _config_lock;
+      Config              _config;
+      volatile bool       _reconfigure;
+      int                 _wakefd;
+      int                 _donefd;
+      volatile bool       _running;
+      bool                _started;
+      pthread_t           _thread;
+    };
+
+    /*
+     * Collects the requests read during one pass of the event loop so
+     * identical queries from different connections only run once.
+     */
+    class Batch {
+    public:
+      Batch(Worker* worker);
+      ~Batch();
+      void add(Request* req);
+      void submit();
+      Request* rejected();
+
+    private:
+      static bool is_query(const std::string& cmd);
+
+    private:
+      typedef std::map<std::string, unsigned> LeaderMap;
+      typedef std::map<unsigned, unsigned> PositionMap;
+      Worker*               _worker;
+      std::vector<Request*> _queued;
+      std::vector<Request*> _rejected;
+      LeaderMap             _leaders;
+      PositionMap           _last;
+    };
+  }
+}
+
+#endif
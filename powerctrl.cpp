@@ -1,11 +1,17 @@
 #include "Server.hh"
+#include "Config.hh"
+#include "Backend.hh"
 #include "Reader.hh"
 #include "Simulator.hh"
+#include "Gateway.hh"
 
 #include <getopt.h>
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace Pds::Jungfrau;
 
@@ -21,25 +27,50 @@ static void showUsage(const char* p)
   std::cout << "Usage: " << p << " [-v|--version] [-h|--help]" << std::endl
             << "-p|--path <path> -l|--logdir <logdir> [-P|--port <port>]" << std::endl
             << "[-c|--conn <connections>] [-b|--boards <nboards>]" << std::endl
-            << "[-g|--gfms <ngfms>] [-f|--fans <nfans>] [--s|--sim]" << std::endl
-            << "[-n|--name <name>]" << std::endl
+            << "[-g|--gfms <ngfms>] [-f|--fans <nfans>] [--s|--sim] [-D|--drive] [-m|--memory]" << std::endl
+            << "[-n|--name <name>] [-u|--ramp-up <ms>] [-d|--ramp-down <ms>] [-S|--stream <rate>]" << std::endl
+            << "[-e|--bme <device>] [-V|--verify <ms>] [-G|--gateway <host:port>] [-t|--stagger <ms>]" << std::endl
+            << "[-M|--metrics <port>] [-q|--queue <clients>] [-i|--idle <seconds>]" << std::endl
+            << "[-N|--nodelay] [-K|--keepalive <idle>[:<intvl>[:<count>]]] [-B|--buffer <bytes>]" << std::endl
+            << "[-L|--listen <tcp:port|tcp6:port|unix:path>] [-C|--config <file>]" << std::endl
+            << "[-w|--slow <ms>] [-T|--stall <ms>] [-W|--watchdog <device>]" << std::endl
             << " Options:" << std::endl
             << "    -p|--path     <path>                    the path to the power control scripts" << std::endl
             << "    -l|--logdir   <logdir>                  the logdir of the power control scripts" << std::endl
             << "    -n|--name     <name>                    the name of the device (default: JF4MD-CTRL)" << std::endl
-            << "    -P|--port     <port>                    port to use for the server (default: 32415)" << std::endl
+            << "    -P|--port     <port>                    port to use for the server, 0 for none (default: 32415)" << std::endl
             << "    -c|--conn     <connections>             maximum number of connections (default: 3)" << std::endl
             << "    -b|--boards   <nboards>                 number of power supply/gpio boards (default: 1)" << std::endl
             << "    -g|--gfms     <ngfms>                   number of flow meters (default: 0)" << std::endl
             << "    -f|--fans     <nfans>                   number of fans (default: 1)" << std::endl
+            << "    -e|--bme      <device>                  serial port of the BME sensor (default: none, <logdir>/BME with -s)" << std::endl
+            << "    -V|--verify   <ms>                      period of the hardware state recheck, 0 to disable (default: 1000)" << std::endl
+            << "    -G|--gateway  <host:port>               run as a gateway to the powerctrl of a chassis (repeat for each chassis)" << std::endl
+            << "    -t|--stagger  <ms>                      delay between powering each chassis in gateway mode (default: 1000)" << std::endl
+            << "    -M|--metrics  <port>                    port to serve the metrics page on (default: none)" << std::endl
+            << "    -q|--queue    <clients>                 clients held waiting for a free connection (default: 2)" << std::endl
+            << "    -i|--idle     <seconds>                 close connections silent for longer than this, 0 to disable (default: 0)" << std::endl
+            << "    -N|--nodelay                            set TCP_NODELAY on the control connections" << std::endl
+            << "    -K|--keepalive <idle>[:<intvl>[:<count>]] probe silent control connections after <idle> seconds" << std::endl
+            << "    -B|--buffer   <bytes>                   socket receive and send buffer size (default: system)" << std::endl
+            << "    -L|--listen   <spec>                    also accept connections on tcp:<port>, tcp6:<port> or unix:<path> (repeatable)" << std::endl
+            << "    -C|--config   <file>                    file of '<option> <value>' lines for name, conn, boards, gfms and fans, reread on SIGHUP" << std::endl
+            << "    -w|--slow     <ms>                      log any command or loop pass that takes longer, 0 to disable (default: 1000)" << std::endl
+            << "    -T|--stall    <ms>                      time a command can run before the worker counts as stuck, 0 to disable (default: 30000)" << std::endl
+            << "    -W|--watchdog <device>                  hardware watchdog to pet while the worker isn't stuck (default: none)" << std::endl
             << "    -s|--sim                                simulate extra sensors" << std::endl
+            << "    -D|--drive                              with -s, write the simulated supply model into the files under <path>" << std::endl
+            << "    -m|--memory                             simulate the power control hardware in memory" << std::endl
+            << "    -u|--ramp-up  <ms>                      time constant of the simulated supply ramp up (default: 100)" << std::endl
+            << "    -d|--ramp-down <ms>                     time constant of the simulated supply ramp down (default: 500)" << std::endl
+            << "    -S|--stream   <rate>                    stream simulated BME frames at <rate> Hz" << std::endl
             << "    -v|--version                            show file version" << std::endl
             << "    -h|--help                               print this message and exit" << std::endl;
 }
 
 int main(int argc, char *argv[])
 {
-  const char*         strOptions  = ":vhp:l:n:P:c:b:g:f:s";
+  const char*         strOptions  = ":vhp:l:n:P:c:b:g:f:e:V:G:t:M:q:i:NK:B:L:C:w:T:W:sDmu:d:S:";
   const struct option loOptions[] =
   {
     {"ver",         0, 0, 'v'},
@@ -52,20 +83,51 @@ int main(int argc, char *argv[])
     {"boards",      1, 0, 'b'},
     {"gfms",        1, 0, 'g'},
     {"fans",        1, 0, 'f'},
+    {"bme",         1, 0, 'e'},
+    {"verify",      1, 0, 'V'},
+    {"gateway",     1, 0, 'G'},
+    {"stagger",     1, 0, 't'},
+    {"metrics",     1, 0, 'M'},
+    {"queue",       1, 0, 'q'},
+    {"idle",        1, 0, 'i'},
+    {"nodelay",     0, 0, 'N'},
+    {"keepalive",   1, 0, 'K'},
+    {"buffer",      1, 0, 'B'},
+    {"listen",      1, 0, 'L'},
+    {"config",      1, 0, 'C'},
+    {"slow",        1, 0, 'w'},
+    {"stall",       1, 0, 'T'},
+    {"watchdog",    1, 0, 'W'},
     {"sim",         0, 0, 's'},
+    {"drive",       0, 0, 'D'},
+    {"memory",      0, 0, 'm'},
+    {"ramp-up",     1, 0, 'u'},
+    {"ramp-down",   1, 0, 'd'},
+    {"stream",      1, 0, 'S'},
     {0,             0, 0,  0 }
   };
 
   bool lUsage = false;
   bool simulate = false;
+  bool drive = false;
+  bool memory = false;
   unsigned port  = 32415;
-  unsigned conns = 3;
-  unsigned boards = 1;
-  unsigned gfms = 0;
-  unsigned fans = 1;
+  unsigned verify = 1000;
+  unsigned stagger = 1000;
+  unsigned metrics = 0;
+  unsigned queue = 2;
+  unsigned idle = 0;
+  SocketOptions sockopts;
+  WatchdogOptions watchdog;
+  double tau_on = 0.1;
+  double tau_off = 0.5;
+  double rate = 0.0;
   std::string path;
   std::string logdir;
-  std::string name = "JF4MD-CTRL";
+  std::string bme;
+  Config config;
+  std::vector<std::string> chassis;
+  std::vector<std::string> listen;
 
   int optionIndex  = 0;
   while ( int opt = getopt_long(argc, argv, strOptions, loOptions, &optionIndex ) ) {
@@ -85,26 +147,89 @@ int main(int argc, char *argv[])
         logdir = std::string(optarg);
         break;
       case 'n':
-        name = std::string(optarg);
+        config.name = std::string(optarg);
         break;
       case 'P':
         port = std::strtoul(optarg, NULL, 0);
         break;
       case 'c':
-        conns = std::strtoul(optarg, NULL, 0);
+        config.conns = std::strtoul(optarg, NULL, 0);
         break;
       case 'b':
-        boards = std::strtoul(optarg, NULL, 0);
+        config.boards = std::strtoul(optarg, NULL, 0);
         break;
       case 'g':
-        gfms = std::strtoul(optarg, NULL, 0);
+        config.gfms = std::strtoul(optarg, NULL, 0);
         break;
       case 'f':
-        fans = std::strtoul(optarg, NULL, 0);
+        config.fans = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'e':
+        bme = std::string(optarg);
+        break;
+      case 'V':
+        verify = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'G':
+        chassis.push_back(std::string(optarg));
+        break;
+      case 't':
+        stagger = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'M':
+        metrics = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'q':
+        queue = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'i':
+        idle = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'N':
+        sockopts.nodelay = true;
+        break;
+      case 'K':
+        if (std::sscanf(optarg, "%u:%u:%u", &sockopts.keepidle, &sockopts.keepintvl, &sockopts.keepcnt) < 1) {
+          std::cout << argv[0] << ": invalid keepalive -- " << optarg << std::endl;
+          lUsage = true;
+        }
+        break;
+      case 'B':
+        sockopts.bufsize = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'L':
+        listen.push_back(std::string(optarg));
+        break;
+      case 'C':
+        config.file = std::string(optarg);
+        break;
+      case 'w':
+        watchdog.slow = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'T':
+        watchdog.stall = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'W':
+        watchdog.device = std::string(optarg);
         break;
       case 's':
         simulate = true;
         break;
+      case 'D':
+        drive = true;
+        break;
+      case 'm':
+        memory = true;
+        break;
+      case 'u':
+        tau_on = std::strtod(optarg, NULL) / 1000.0;
+        break;
+      case 'd':
+        tau_off = std::strtod(optarg, NULL) / 1000.0;
+        break;
+      case 'S':
+        rate = std::strtod(optarg, NULL);
+        break;
       case '?':
         if (optopt)
           std::cout << argv[0] << ": Unknown option: " << static_cast<char>(optopt) << std::endl;
@@ -122,12 +247,22 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (path.empty()) {
+  if (path.empty() && !memory && chassis.empty()) {
     std::cout << argv[0] << ": path to the power control scripts is required" << std::endl;
     lUsage = true;
   }
 
-  if (logdir.empty()) {
+  if (drive && !simulate) {
+    std::cout << argv[0] << ": -D needs the simulator enabled with -s" << std::endl;
+    lUsage = true;
+  }
+
+  if (metrics && !verify && chassis.empty()) {
+    std::cout << argv[0] << ": the metrics page needs the -V recheck to take its readings" << std::endl;
+    lUsage = true;
+  }
+
+  if (logdir.empty() && chassis.empty()) {
     std::cout << argv[0] << ": path to the logdir of the power control scripts is required" << std::endl;
     lUsage = true;
   }
@@ -137,19 +272,69 @@ int main(int argc, char *argv[])
     lUsage = true;
   }
 
+  if (port) {
+    std::ostringstream tcp;
+    tcp << "tcp:" << port;
+    listen.insert(listen.begin(), tcp.str());
+  }
+
+  if (listen.empty()) {
+    std::cout << argv[0] << ": at least one port or listener is required" << std::endl;
+    lUsage = true;
+  }
+
+  // the config file has the last word over the command line
+  if (!config.load()) {
+    lUsage = true;
+  }
+
   if (lUsage) {
     showUsage(argv[0]);
     return 1;
   }
 
-  if (simulate) {
-    Simulator sim(logdir);
-    Server srv(name, path, logdir, port, conns, &sim, boards, boards, gfms, fans);
+  if ((tau_on <= 0.0) || (tau_off <= 0.0)) {
+    std::cout << argv[0] << ": the simulated supply ramp times must be positive" << std::endl;
+    showUsage(argv[0]);
+    return 1;
+  }
+
+  if (!chassis.empty()) {
+    // the gateway owns no hardware, only the connections to each chassis
+    Server srv(new Gateway(config.name, chassis, stagger), config, listen, 0, metrics, queue, idle, sockopts, watchdog);
     srv.run();
+    return 0;
+  }
+
+  Simulator* sim = NULL;
+  Backend* backend = NULL;
+  if (simulate) {
+    sim = new Simulator(logdir);
+    if (rate > 0.0) sim->stream(rate);
+    if (bme.empty()) bme = File(logdir, "BME").filename();
+  }
+
+  // the memory backend and the simulator model keep the startup layout
+  config.fixed = memory || drive;
+
+  if (memory) {
+    MemoryBackend* mem = new MemoryBackend(config.boards, config.boards, config.gfms, config.fans,
+                                           tau_on, tau_off);
+    if (sim) sim->attach(mem, config.boards);
+    backend = mem;
   } else {
-    Server srv(name, path, logdir, port, conns, NULL, boards, boards, gfms, fans);
+    // only on request, the model must never write into a real sysfs tree
+    if (sim && drive) sim->drive(path, config.boards, config.boards, tau_on, tau_off);
+    backend = new SysfsBackend(path);
+  }
+
+  {
+    Server srv(config, backend, logdir, listen, sim, bme, verify, metrics, queue, idle, sockopts, watchdog);
     srv.run();
   }
 
+  delete backend;
+  if (sim) delete sim;
+
   return 0;
 }
@@ -0,0 +1,603 @@
+#include <getopt.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static std::string JungfrauPowerLoadVersion = "1.0";
+
+static const char* DefaultMix[] = {
+  "STATE?",
+  "MODULES?",
+  "BLOCK?",
+  "PS0:TEMP?",
+  "PS0:VOLT?",
+  "PS0:CURR?",
+  "GPIO0:ENABLE?",
+  "GPIO0:WARN:DC?",
+  "FMON0:INPUT?",
+  NULL
+};
+
+struct Command {
+  std::string text;
+  unsigned    weight;
+  bool        reply;
+};
+
+struct Pending {
+  double   sent;
+  unsigned cmd;
+};
+
+struct Stats {
+  unsigned long sent;
+  unsigned long replies;
+  unsigned long errors;
+  unsigned long timeouts;
+  unsigned long disconnects;
+  double        lat_sum;
+  double        lat_min;
+  double        lat_max;
+};
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool expects_reply(const std::string& cmd, bool ack)
+{
+  if (ack) return true;
+  if (cmd.empty()) return false;
+  // getters always answer and so does the verbose form of STATE
+  return cmd[cmd.length() - 1] == '?' || !cmd.compare(0, 6, "STATE ");
+}
+
+class LoadClient {
+public:
+  LoadClient(unsigned id,
+             const struct addrinfo* addr,
+             const std::vector<Command>& mix,
+             unsigned total_weight,
+             double rate,
+             unsigned depth,
+             double timeout,
+             bool nodelay) :
+    _id(id),
+    _addr(addr),
+    _mix(mix),
+    _total_weight(total_weight),
+    _period(rate > 0.0 ? 1.0 / rate : 0.0),
+    _depth(depth),
+    _timeout(timeout),
+    _nodelay(nodelay),
+    _fd(-1),
+    _seed(id + 1),
+    _next(0.0),
+    _retry(0.0),
+    _rlen(0)
+  {
+    std::memset(&_stats, 0, sizeof(_stats));
+    _stats.lat_min = HUGE_VAL;
+  }
+
+  ~LoadClient()
+  {
+    disconnect();
+  }
+
+  int fd() const { return _fd; }
+  bool ready(double t) const { return _fd < 0 && t >= _retry; }
+  const Stats& stats() const { return _stats; }
+  const std::vector<double>& latencies() const { return _lat; }
+
+  bool connect(double t)
+  {
+    _fd = ::socket(_addr->ai_family, _addr->ai_socktype, _addr->ai_protocol);
+    if (_fd < 0) {
+      std::perror("Error: client socket creation failed");
+      return false;
+    }
+    if (_nodelay) {
+      int opt = 1;
+      if (::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0)
+        std::perror("Error: setsockopt TCP_NODELAY failed on client socket");
+    }
+    if (::connect(_fd, _addr->ai_addr, _addr->ai_addrlen) < 0) {
+      std::perror("Error: client connect failed");
+      ::close(_fd);
+      _fd = -1;
+      _retry = t + 1.0;
+      return false;
+    }
+    ::fcntl(_fd, F_SETFL, ::fcntl(_fd, F_GETFL) | O_NONBLOCK);
+    _rlen = 0;
+    _next = t;
+    return true;
+  }
+
+  void disconnect(double t=0.0)
+  {
+    if (_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+    _pending.clear();
+    _wbuf.clear();
+    _retry = t + 0.1;
+  }
+
+  bool writing() const { return !_wbuf.empty(); }
+
+  // fire off as many commands as the rate and the pipeline depth allow
+  bool send(double t)
+  {
+    // the server isn't keeping up, so don't queue more behind what's left
+    if (writing()) return true;
+    // commands without a reply don't fill the pipeline, so bound each batch too
+    for (unsigned n=0; n < _depth && _pending.size() < _depth && t >= _next; n++) {
+      unsigned idx = pick();
+      _wbuf += _mix[idx].text;
+      _wbuf += '\n';
+      if (_mix[idx].reply) {
+        Pending p = { t, idx };
+        _pending.push_back(p);
+      }
+      _stats.sent++;
+      if (_period > 0.0) {
+        _next += _period;
+        // don't try to catch up on sends missed while stalled
+        if (_next < t - _timeout) _next = t;
+      }
+    }
+    return flush(t);
+  }
+
+  // write what the socket takes now, the rest goes out on POLLOUT
+  bool flush(double t)
+  {
+    while (writing()) {
+      ssize_t nsent = ::send(_fd, _wbuf.c_str(), _wbuf.length(), MSG_NOSIGNAL);
+      if (nsent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return true;
+        if (errno == EINTR)
+          continue;
+        std::perror("Error: client send failed");
+        _stats.disconnects++;
+        disconnect(t);
+        return false;
+      }
+      _wbuf.erase(0, nsent);
+    }
+    return true;
+  }
+
+  bool recv(double t)
+  {
+    ssize_t nread = ::recv(_fd, _rbuf + _rlen, sizeof(_rbuf) - _rlen, 0);
+    if (nread <= 0) {
+      if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return true;
+      _stats.disconnects++;
+      disconnect(t);
+      return false;
+    }
+    _rlen += nread;
+
+    size_t start = 0;
+    for (size_t i=0; i<_rlen; i++) {
+      if (_rbuf[i] == '\n') {
+        reply(std::string(_rbuf + start, i - start), t);
+        start = i + 1;
+      }
+    }
+    if (start > 0) {
+      std::memmove(_rbuf, _rbuf + start, _rlen - start);
+      _rlen -= start;
+    } else if (_rlen == sizeof(_rbuf)) {
+      // a reply that doesn't fit is garbage anyway
+      _stats.errors++;
+      _rlen = 0;
+    }
+    return true;
+  }
+
+  // returns false when a reply has not been seen in time
+  bool check(double t)
+  {
+    if (!_pending.empty() && (t - _pending.front().sent) > _timeout) {
+      _stats.timeouts++;
+      // the stream can't be resynchronized so start over
+      disconnect(t);
+      return false;
+    }
+    return true;
+  }
+
+  // how long until this client next needs attention
+  double wait(double t) const
+  {
+    double w = HUGE_VAL;
+    if (_fd < 0) return std::max(0.0, _retry - t);
+    if (_pending.size() < _depth && !writing())
+      w = std::max(0.0, _next - t);
+    if (!_pending.empty())
+      w = std::min(w, std::max(0.0, _pending.front().sent + _timeout - t));
+    return w;
+  }
+
+private:
+  unsigned pick()
+  {
+    unsigned r = rand_r(&_seed) % _total_weight;
+    for (unsigned i=0; i<_mix.size(); i++) {
+      if (r < _mix[i].weight) return i;
+      r -= _mix[i].weight;
+    }
+    return 0;
+  }
+
+  void reply(const std::string& msg, double t)
+  {
+    if (_pending.empty()) {
+      // a reply to nothing that we sent
+      _stats.errors++;
+      return;
+    }
+    double lat = t - _pending.front().sent;
+    _pending.pop_front();
+    _stats.replies++;
+    _stats.lat_sum += lat;
+    if (lat < _stats.lat_min) _stats.lat_min = lat;
+    if (lat > _stats.lat_max) _stats.lat_max = lat;
+    _lat.push_back(lat);
+    if (!msg.compare(0, 4, "ERR "))
+      _stats.errors++;
+  }
+
+private:
+  const unsigned               _id;
+  const struct addrinfo*       _addr;
+  const std::vector<Command>&  _mix;
+  const unsigned               _total_weight;
+  const double                 _period;
+  const unsigned               _depth;
+  const double                 _timeout;
+  const bool                   _nodelay;
+  int                          _fd;
+  unsigned                     _seed;
+  double                       _next;
+  double                       _retry;
+  size_t                       _rlen;
+  char                         _rbuf[4096];
+  std::string                  _wbuf;
+  std::deque<Pending>          _pending;
+  std::vector<double>          _lat;
+  Stats                        _stats;
+};
+
+static bool load_mix(const std::string& filename, std::vector<Command>& mix)
+{
+  std::ifstream file(filename.c_str());
+  if (!file.is_open()) {
+    std::cerr << "Error: unable to open command mix file " << filename << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    std::istringstream ss(line);
+    Command cmd;
+    if (!(ss >> cmd.weight)) {
+      std::cerr << "Error: invalid command mix line: " << line << std::endl;
+      return false;
+    }
+    std::getline(ss >> std::ws, cmd.text);
+    if (cmd.text.empty() || cmd.weight == 0) {
+      std::cerr << "Error: invalid command mix line: " << line << std::endl;
+      return false;
+    }
+    mix.push_back(cmd);
+  }
+  return true;
+}
+
+static double percentile(const std::vector<double>& sorted, double pct)
+{
+  if (sorted.empty()) return 0.0;
+  size_t idx = (size_t) (pct / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[idx];
+}
+
+static void showVersion(const char* p)
+{
+  std::cout << "Version:  " << p << "  Ver " << JungfrauPowerLoadVersion << std::endl;
+}
+
+static void showUsage(const char* p)
+{
+  std::cout << "Usage: " << p << " [-v|--version] [-h|--help]" << std::endl
+            << "[-H|--host <host>] [-P|--port <port>] [-c|--clients <nclients>]" << std::endl
+            << "[-r|--rate <rate>] [-d|--depth <depth>] [-t|--time <seconds>]" << std::endl
+            << "[-T|--timeout <ms>] [-m|--mix <file>] [-C|--cmd <command>] [-a|--ack] [-N|--nodelay]" << std::endl
+            << " Options:" << std::endl
+            << "    -H|--host     <host>                    host running powerctrl (default: localhost)" << std::endl
+            << "    -P|--port     <port>                    port of the powerctrl server (default: 32415)" << std::endl
+            << "    -c|--clients  <nclients>                number of concurrent connections (default: 3)" << std::endl
+            << "    -r|--rate     <rate>                    commands per second per client, 0 for unpaced (default: 10)" << std::endl
+            << "    -d|--depth    <depth>                   maximum commands in flight per client (default: 1)" << std::endl
+            << "    -t|--time     <seconds>                 duration of the run (default: 10)" << std::endl
+            << "    -T|--timeout  <ms>                      time to wait for a reply (default: 3500)" << std::endl
+            << "    -m|--mix      <file>                    file of '<weight> <command>' lines to replay" << std::endl
+            << "    -C|--cmd      <command>                 add a command to the mix with weight 1" << std::endl
+            << "    -a|--ack                                expect a reply to every command, not only getters" << std::endl
+            << "    -N|--nodelay                            set TCP_NODELAY on the client sockets" << std::endl
+            << "    -v|--version                            show file version" << std::endl
+            << "    -h|--help                               print this message and exit" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  const char*         strOptions  = ":vhH:P:c:r:d:t:T:m:C:aN";
+  const struct option loOptions[] =
+  {
+    {"ver",         0, 0, 'v'},
+    {"help",        0, 0, 'h'},
+    {"host",        1, 0, 'H'},
+    {"port",        1, 0, 'P'},
+    {"clients",     1, 0, 'c'},
+    {"rate",        1, 0, 'r'},
+    {"depth",       1, 0, 'd'},
+    {"time",        1, 0, 't'},
+    {"timeout",     1, 0, 'T'},
+    {"mix",         1, 0, 'm'},
+    {"cmd",         1, 0, 'C'},
+    {"ack",         0, 0, 'a'},
+    {"nodelay",     0, 0, 'N'},
+    {0,             0, 0,  0 }
+  };
+
+  bool lUsage = false;
+  bool ack = false;
+  bool nodelay = false;
+  std::string host = "localhost";
+  std::string port = "32415";
+  unsigned nclients = 3;
+  double rate = 10.0;
+  unsigned depth = 1;
+  double duration = 10.0;
+  double timeout = 3.5;
+  std::vector<Command> mix;
+
+  int optionIndex  = 0;
+  while ( int opt = getopt_long(argc, argv, strOptions, loOptions, &optionIndex ) ) {
+    if ( opt == -1 ) break;
+
+    switch(opt) {
+      case 'h':               /* Print usage */
+        showUsage(argv[0]);
+        return 0;
+      case 'v':               /* Print version */
+        showVersion(argv[0]);
+        return 0;
+      case 'H':
+        host = std::string(optarg);
+        break;
+      case 'P':
+        port = std::string(optarg);
+        break;
+      case 'c':
+        nclients = std::strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        rate = std::strtod(optarg, NULL);
+        break;
+      case 'd':
+        depth = std::strtoul(optarg, NULL, 0);
+        break;
+      case 't':
+        duration = std::strtod(optarg, NULL);
+        break;
+      case 'T':
+        timeout = std::strtod(optarg, NULL) / 1000.0;
+        break;
+      case 'm':
+        if (!load_mix(optarg, mix)) lUsage = true;
+        break;
+      case 'C':
+        {
+          Command cmd = { std::string(optarg), 1, false };
+          mix.push_back(cmd);
+        }
+        break;
+      case 'a':
+        ack = true;
+        break;
+      case 'N':
+        nodelay = true;
+        break;
+      case '?':
+        if (optopt)
+          std::cout << argv[0] << ": Unknown option: " << static_cast<char>(optopt) << std::endl;
+        else
+          std::cout << argv[0] << ": Unknown option: " << argv[optind-1] << std::endl;
+        lUsage = true;
+        break;
+      case ':':
+        std::cout << argv[0] << ": Missing argument for " << static_cast<char>(optopt) << std::endl;
+        lUsage = true;
+        break;
+      default:
+        lUsage = true;
+        break;
+    }
+  }
+
+  if (nclients == 0) {
+    std::cout << argv[0] << ": at least one client is required" << std::endl;
+    lUsage = true;
+  }
+
+  if (depth == 0) {
+    std::cout << argv[0] << ": the pipeline depth must be at least one" << std::endl;
+    lUsage = true;
+  }
+
+  if (optind < argc) {
+    std::cout << argv[0] << ": invalid argument -- " << argv[optind] << std::endl;
+    lUsage = true;
+  }
+
+  if (lUsage) {
+    showUsage(argv[0]);
+    return 1;
+  }
+
+  if (mix.empty()) {
+    for (unsigned i=0; DefaultMix[i]; i++) {
+      Command cmd = { std::string(DefaultMix[i]), 1, false };
+      mix.push_back(cmd);
+    }
+  }
+
+  unsigned total_weight = 0;
+  for (unsigned i=0; i<mix.size(); i++) {
+    mix[i].reply = expects_reply(mix[i].text, ack);
+    total_weight += mix[i].weight;
+  }
+
+  struct addrinfo hints;
+  struct addrinfo* addr = NULL;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int err = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &addr);
+  if (err) {
+    std::cerr << "Error: unable to resolve " << host << ":" << port << ": "
+              << gai_strerror(err) << std::endl;
+    return 1;
+  }
+
+  std::vector<LoadClient*> clients;
+  std::vector<pollfd> pfds(nclients);
+  double start = now();
+  for (unsigned i=0; i<nclients; i++) {
+    clients.push_back(new LoadClient(i, addr, mix, total_weight, rate, depth, timeout, nodelay));
+    clients[i]->connect(start);
+  }
+
+  double end = start + duration;
+  double t = start;
+  while (t < end) {
+    double wait = end - t;
+    for (unsigned i=0; i<nclients; i++) {
+      if (clients[i]->ready(t)) {
+        // reconnect like StreamDevice would
+        clients[i]->connect(t);
+      }
+      if (clients[i]->fd() >= 0) {
+        clients[i]->send(t);
+      }
+      pfds[i].fd = clients[i]->fd();
+      pfds[i].events = clients[i]->writing() ? POLLIN | POLLOUT : POLLIN;
+      pfds[i].revents = 0;
+      wait = std::min(wait, clients[i]->wait(t));
+    }
+
+    int npoll = ::poll(&pfds[0], nclients, (int) std::ceil(wait * 1000.0));
+    if (npoll < 0) {
+      std::perror("Error: client poller failed");
+      break;
+    }
+
+    t = now();
+    for (unsigned i=0; i<nclients; i++) {
+      if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        clients[i]->recv(t);
+      }
+      if ((pfds[i].revents & POLLOUT) && clients[i]->fd() >= 0) {
+        clients[i]->flush(t);
+      }
+      if (clients[i]->fd() >= 0) {
+        clients[i]->check(t);
+      }
+    }
+  }
+  double elapsed = now() - start;
+
+  // per client summary
+  std::vector<double> all;
+  Stats total;
+  std::memset(&total, 0, sizeof(total));
+  double sum_tput = 0.0;
+  double sum_tput2 = 0.0;
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "client      sent   replies    errors  timeouts  discons  avg(ms)  min(ms)  max(ms)" << std::endl;
+  for (unsigned i=0; i<nclients; i++) {
+    const Stats& s = clients[i]->stats();
+    const std::vector<double>& lat = clients[i]->latencies();
+    all.insert(all.end(), lat.begin(), lat.end());
+    total.sent += s.sent;
+    total.replies += s.replies;
+    total.errors += s.errors;
+    total.timeouts += s.timeouts;
+    total.disconnects += s.disconnects;
+    double tput = s.replies / elapsed;
+    sum_tput += tput;
+    sum_tput2 += tput * tput;
+    std::cout << std::setw(6) << i
+              << std::setw(10) << s.sent
+              << std::setw(10) << s.replies
+              << std::setw(10) << s.errors
+              << std::setw(10) << s.timeouts
+              << std::setw(9) << s.disconnects
+              << std::setw(9) << (s.replies ? s.lat_sum / s.replies * 1e3 : 0.0)
+              << std::setw(9) << (s.replies ? s.lat_min * 1e3 : 0.0)
+              << std::setw(9) << s.lat_max * 1e3
+              << std::endl;
+  }
+
+  std::sort(all.begin(), all.end());
+  // Jain's fairness index of the per client reply throughput
+  double fairness = sum_tput2 > 0.0 ? (sum_tput * sum_tput) / (nclients * sum_tput2) : 0.0;
+  std::cout << std::endl
+            << "elapsed:     " << elapsed << " s" << std::endl
+            << "sent:        " << total.sent << std::endl
+            << "replies:     " << total.replies << " (" << total.replies / elapsed << "/s)" << std::endl
+            << "errors:      " << total.errors << std::endl
+            << "timeouts:    " << total.timeouts << std::endl
+            << "disconnects: " << total.disconnects << std::endl
+            << "latency:     p50 " << percentile(all, 50.0) * 1e3
+            << " ms, p90 " << percentile(all, 90.0) * 1e3
+            << " ms, p99 " << percentile(all, 99.0) * 1e3
+            << " ms, max " << (all.empty() ? 0.0 : all.back()) * 1e3 << " ms" << std::endl
+            << "fairness:    " << fairness << std::endl;
+
+  for (unsigned i=0; i<nclients; i++) {
+    delete clients[i];
+  }
+  ::freeaddrinfo(addr);
+
+  return (total.timeouts || total.errors) ? 2 : 0;
+}